@@ -0,0 +1,20 @@
+#!/bin/sh
+# Sweeps the rule engine over rule counts, thread counts and rule shapes with ruleBench.
+# Prints one line of key=value results per run - keep the output of a known-good build to compare later builds against.
+# Usage: ./benchRules.sh [requests per thread] [thread counts]
+
+set -e
+cd "$(dirname "$0")"
+
+REQUESTS=${1:-200000}
+THREADS=${2:-1,4}
+
+gcc -O2 -pthread ruleBench.c serverCSubmission.c -o ruleBench
+
+for SHAPE in cidr exact range; do
+    ./ruleBench -k $SHAPE -r 10,1000,100000,1000000 -t "$THREADS" -n "$REQUESTS"
+done
+./ruleBench -k cidr -r 100000 -t "$THREADS" -n "$REQUESTS" -m 50/25/25
+./ruleBench -k cidr -r 100000 -t "$THREADS" -n "$REQUESTS" -h 0.05
+./ruleBench -k cidr -r 100000,1000000 -t "$THREADS" -n "$REQUESTS" -z 2000  #skewed traffic, the case the decision cache is for
+./ruleBench -k v6 -r 10,1000 -t "$THREADS" -n "$REQUESTS"  #IPv6 rules are scanned, so the larger counts would take too long
@@ -0,0 +1,26 @@
+#!/bin/sh
+# Compares ruleServer's epoll and io_uring transports on loopback.
+# Builds ruleServer and loadGenerator, then runs the same load against each transport in turn.
+# Usage: ./benchTransports.sh [server threads] [seconds] [connections] [pipeline depth]
+
+set -e
+cd "$(dirname "$0")"
+
+THREADS=${1:-2}
+SECONDS_PER_RUN=${2:-5}
+CONNECTIONS=${3:-64}
+DEPTH=${4:-32}
+PORT=9091
+
+gcc -O2 -pthread ruleServer.c serverCSubmission.c -o ruleServer
+gcc -O2 -pthread loadGenerator.c -o loadGenerator
+
+for MODE in epoll uring; do
+    ./ruleServer -p $PORT -t "$THREADS" -m $MODE &
+    SERVER=$!
+    sleep 1  #give every worker time to bind its listening socket
+    printf '%s: ' $MODE
+    ./loadGenerator -p $PORT -c "$CONNECTIONS" -t "$THREADS" -d "$SECONDS_PER_RUN" -q "$DEPTH"
+    kill $SERVER
+    wait $SERVER 2>/dev/null || true
+done
@@ -0,0 +1,196 @@
+/* Crash-recovery test for the write-ahead log in serverCSubmission.c.
+Each round forks a writer that opens the log and adds rules from several threads at once - text A requests and binary BIN_ADD frames -
+so that their records share group commits. Every rule the writer has had a reply for (an ack) is reported to the parent down a pipe,
+and the parent SIGKILLs the writer at a random point while it is still committing.
+The parent then appends a torn record to the log - the full length, but with bytes that do not match its FNV-1a check, as a write cut short by the crash would leave it -
+and forks a reader that reopens the log with openWal. The reader checks that:
+ - every acked rule was replayed, and R lists the request that added it (binary ones in their text form)
+ - the torn record was discarded: its rule is not there, and the file has been cut back to where it started
+Rounds build on each other's log, so later rounds also replay the records of the earlier ones.
+The engine is included rather than linked so the test can build a record with WalRecord and wal_check.
+
+Build: gcc -O2 -pthread crashTest.c -o crashTest
+Run:   ./crashTest [rounds] [seed] */
+
+#include "serverCSubmission.c"
+#include <signal.h>
+#include <sys/wait.h>
+
+#define CRASH_WRITERS 4  //writer threads - the last one sends binary frames
+#define CRASH_MAX_ACKS (1 << 20)
+
+static int ack_pipe[2];
+static uint32_t *acked;  //ids of every rule acked so far, over all rounds
+static size_t acked_count;
+
+//ids are <round> << 16 | <writer> << 8 | <n>, and the rule for one is 10.<round>.<writer>.<n> with port n + 1 - one rule per ip, so a C can tell them apart
+static void rule_for(uint32_t id, uint32_t *ip, int *port) {
+    *ip = 10u << 24 | (id & 0xffffff);
+    *port = 1 + (int)(id & 255);
+}
+
+static size_t rule_text(char *out, uint32_t id) {
+    uint32_t ip;
+    int port;
+    rule_for(id, &ip, &port);
+    return (size_t)sprintf(out, "%u.%u.%u.%u %d", ip >> 24, ip >> 16 & 255, ip >> 8 & 255, ip & 255, port);
+}
+
+//adds rules until it is killed, reporting each one down the pipe once its reply is back
+static void *writer(void *arg) {
+    uint32_t base = (uint32_t)(uintptr_t)arg;
+    for (uint32_t n = 0; n < 256; n++) {
+        uint32_t id = base | n;
+        uint32_t ip;
+        int port;
+        rule_for(id, &ip, &port);
+        int ok;
+        if ((base >> 8 & 255) == CRASH_WRITERS - 1) {
+            uint8_t frame[13] = { BIN_ADD, ip >> 24, ip >> 16 & 255, ip >> 8 & 255, ip & 255, ip >> 24, ip >> 16 & 255, ip >> 8 & 255, ip & 255,
+                                  port >> 8, port & 255, port >> 8, port & 255 };
+            ok = processBinary(frame) == BIN_STATUS_ADDED;
+        } else {
+            char request[64] = "A ";
+            rule_text(request + 2, id);
+            char *response = processRequest(request);
+            ok = strcmp(response, "Rule added") == 0;
+            free(response);
+        }
+        if (!ok || write(ack_pipe[1], &id, sizeof(id)) != sizeof(id))
+            _exit(2);
+    }
+    return NULL;
+}
+
+static void run_writer(const char *path, int round) {
+    if (!openWal(path, 200))
+        _exit(2);
+    pthread_t tids[CRASH_WRITERS];
+    for (int t = 0; t < CRASH_WRITERS; t++)
+        pthread_create(&tids[t], NULL, writer, (void *)(uintptr_t)((uint32_t)round << 16 | (uint32_t)t << 8));
+    for (int t = 0; t < CRASH_WRITERS; t++)
+        pthread_join(tids[t], NULL);
+    _exit(3);  //ran out of rules before the kill - the parent waits less than that takes
+}
+
+//reopens the log and checks it against the acks - returns the number of failures
+static int run_reader(const char *path, uint32_t torn_id, off_t good_size) {
+    if (!openWal(path, 0)) {
+        perror("openWal");
+        return 1;
+    }
+    int failures = 0;
+    struct stat st;
+    if (stat(path, &st) != 0 || st.st_size != good_size) {
+        printf("the log is %lld bytes after openWal, expected %lld - the torn record was not cut off\n", (long long)st.st_size, (long long)good_size);
+        failures++;
+    }
+
+    char request[64], *log = processRequest(strcpy(request, "R"));
+    for (size_t k = 0; k <= acked_count; k++) {
+        uint32_t id = k < acked_count ? acked[k] : torn_id;
+        char text[64] = "A ";
+        size_t len = 2 + rule_text(text + 2, id);
+        strcpy(request, "C ");
+        rule_text(request + 2, id);
+        char *response = processRequest(request);
+        int present = strcmp(response, "Connection accepted") == 0;
+        free(response);
+        text[len++] = '\n';
+        text[len] = '\0';
+        int listed = strstr(log, text) != NULL;
+        if (k < acked_count && (!present || !listed) && failures++ < 10)
+            printf("acked rule %.*s is %s after recovery\n", (int)len - 3, text + 2, present ? "missing from R" : "missing");
+        if (k == acked_count && (present || listed) && failures++ < 10)
+            printf("the torn record was replayed\n");
+    }
+    free(log);
+    return failures;
+}
+
+//appends a record for torn_id whose text has been changed after its check was worked out
+static void append_torn(const char *path, uint32_t torn_id) {
+    char text[64] = "A ";
+    size_t len = 2 + rule_text(text + 2, torn_id);
+    uint32_t ip;
+    int port;
+    rule_for(torn_id, &ip, &port);
+    WalRecord rec = {0};
+    rec.text_len = (uint32_t)len;
+    rec.lsn = UINT64_MAX;  //newer than anything a snapshot holds
+    rec.op = 'A';
+    rec.ip_start = rec.ip_end = ip;
+    rec.port_start = rec.port_end = (uint16_t)port;
+    rec.check = wal_check(&rec, text);
+    text[len - 1] ^= 1;  //the last byte never made it to the disk as written
+
+    FILE *f = fopen(path, "ab");
+    if (!f || fwrite(&rec, sizeof(rec), 1, f) != 1 || fwrite(text, 1, len, f) != len || fclose(f) != 0) {
+        perror(path);
+        exit(1);
+    }
+}
+
+int main(int argc, char **argv) {
+    int rounds = argc > 1 ? atoi(argv[1]) : 5;
+    srand(argc > 2 ? (unsigned)atoi(argv[2]) : 1);
+    if (rounds < 1 || rounds > 200)
+        rounds = 5;
+    char path[] = "/tmp/crashTestXXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) { perror("mkstemp"); exit(1); }
+    close(fd);
+    acked = malloc(CRASH_MAX_ACKS * sizeof(uint32_t));
+    if (!acked) { perror("malloc"); exit(1); }
+
+    int failures = 0;
+    for (int round = 1; round <= rounds && !failures; round++) {
+        if (pipe(ack_pipe) != 0) { perror("pipe"); exit(1); }
+        pid_t pid = fork();
+        if (pid < 0) { perror("fork"); exit(1); }
+        if (pid == 0) {
+            close(ack_pipe[0]);
+            run_writer(path, round);
+        }
+        close(ack_pipe[1]);
+
+        //lets a random number of acks through, then kills the writer in the middle of whatever commit comes next
+        size_t before = acked_count, wait_for = 20 + (size_t)rand() % 300;
+        uint32_t id;
+        while (acked_count - before < wait_for && read(ack_pipe[0], &id, sizeof(id)) == sizeof(id))
+            acked[acked_count++] = id;
+        kill(pid, SIGKILL);
+        while (read(ack_pipe[0], &id, sizeof(id)) == sizeof(id))  //acks already sent count too
+            acked[acked_count++] = id;
+        close(ack_pipe[0]);
+        int status;
+        waitpid(pid, &status, 0);
+        if (!WIFSIGNALED(status)) {
+            printf("round %d: the writer exited by itself (status %d)\n", round, WEXITSTATUS(status));
+            failures++;
+            break;
+        }
+
+        struct stat st;
+        if (stat(path, &st) != 0) { perror(path); exit(1); }
+        uint32_t torn_id = (uint32_t)round << 16 | 255u << 8;  //a writer number no writer has
+        append_torn(path, torn_id);
+
+        pid = fork();
+        if (pid < 0) { perror("fork"); exit(1); }
+        if (pid == 0) {
+            int reader_failures = run_reader(path, torn_id, st.st_size);
+            fflush(stdout);  //_exit does not flush it
+            _exit(reader_failures ? 1 : 0);
+        }
+        waitpid(pid, &status, 0);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            printf("round %d: recovery failed\n", round);
+            failures++;
+        }
+    }
+
+    unlink(path);
+    printf("crashTest: %d rounds, %zu acked rules checked after each crash, %d failures\n", rounds, acked_count, failures);
+    return failures != 0;
+}
@@ -0,0 +1,181 @@
+/* Loopback load generator for ruleServer.
+Opens a number of connections spread over a number of threads, keeps a fixed number of pipelined C requests in flight on each connection, and reports requests per second once the run is over.
+Run it against servers started with different -t values to see how throughput scales with cores.
+
+Build: gcc -O2 -pthread loadGenerator.c -o loadGenerator
+Run:   ./loadGenerator [-h host] [-p port] [-c connections] [-t threads] [-d seconds] [-q pipeline depth] [-r rules] */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+static const char *host = "127.0.0.1";
+static int port = 8080;
+static int connections = 16;
+static int threads = 4;
+static int seconds = 5;
+static int depth = 32;  //requests kept in flight on each connection
+static int rules = 1000;  //rules loaded before the run
+
+static volatile int running = 1;
+
+// Worker is one load thread and the requests it managed to complete
+typedef struct {
+    pthread_t tid;
+    int conns;
+    unsigned long long done;
+    unsigned seed;
+} Worker;
+
+static int connect_server(void) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) { perror("socket"); exit(1); }
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((uint16_t)port);
+    if (inet_pton(AF_INET, host, &addr.sin_addr) != 1) { fprintf(stderr, "bad host %s\n", host); exit(1); }
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) { perror("connect"); exit(1); }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+static void write_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("write");
+            exit(1);
+        }
+        buf += n;
+        len -= (size_t)n;
+    }
+}
+
+//reads until count more '\n'-terminated responses have arrived
+static void read_responses(int fd, int count) {
+    char buf[65536];
+    while (count > 0) {
+        ssize_t n = read(fd, buf, sizeof(buf));
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR)
+                continue;
+            fprintf(stderr, "server closed the connection\n");
+            exit(1);
+        }
+        for (ssize_t k = 0; k < n; k++)
+            count -= buf[k] == '\n';
+    }
+}
+
+//builds depth C requests for random addresses in 10.0.0.0/16 - about half of them hit a rule
+static size_t build_batch(char *buf, unsigned *seed) {
+    size_t len = 0;
+    for (int k = 0; k < depth; k++)
+        len += (size_t)sprintf(buf + len, "C 10.0.%u.%u %u\n", rand_r(seed) % 256, rand_r(seed) % 256, 1 + rand_r(seed) % 1024);
+    return len;
+}
+
+static void *run(void *arg) {
+    Worker *w = arg;
+    int *fds = malloc((size_t)w -> conns * sizeof(int));
+    char *batch = malloc((size_t)depth * 32);
+    if (!fds || !batch) { perror("malloc"); exit(1); }
+    for (int k = 0; k < w -> conns; k++)
+        fds[k] = connect_server();
+
+    while (running) {
+        //send one full pipeline on every connection, then collect all the answers
+        for (int k = 0; k < w -> conns; k++) {
+            size_t len = build_batch(batch, &w -> seed);
+            write_all(fds[k], batch, len);
+        }
+        for (int k = 0; k < w -> conns; k++)
+            read_responses(fds[k], depth);
+        w -> done += (unsigned long long)w -> conns * (unsigned long long)depth;
+    }
+
+    for (int k = 0; k < w -> conns; k++)
+        close(fds[k]);
+    free(fds);
+    free(batch);
+    return NULL;
+}
+
+//loads the rules the run checks against - a rule for each /24 in 10.0.0.0/16 with an even third octet, over ports 1-512
+static void load_rules(void) {
+    int fd = connect_server();
+    write_all(fd, "F\n", 2);
+    read_responses(fd, 1);
+    char line[64];
+    for (int k = 0; k < rules; k++) {
+        int len = sprintf(line, "A 10.0.%d.0-10.0.%d.255 1-512\n", (k * 2) % 256, (k * 2) % 256);
+        write_all(fd, line, (size_t)len);
+    }
+    read_responses(fd, rules);
+    close(fd);
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "h:p:c:t:d:q:r:")) != -1) {
+        switch (opt) {
+            case 'h': host = optarg; break;
+            case 'p': port = atoi(optarg); break;
+            case 'c': connections = atoi(optarg); break;
+            case 't': threads = atoi(optarg); break;
+            case 'd': seconds = atoi(optarg); break;
+            case 'q': depth = atoi(optarg); break;
+            case 'r': rules = atoi(optarg); break;
+            default:
+                fprintf(stderr, "usage: %s [-h host] [-p port] [-c connections] [-t threads] [-d seconds] [-q depth] [-r rules]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (threads < 1) threads = 1;
+    if (connections < threads) connections = threads;
+    if (depth < 1) depth = 1;
+
+    load_rules();
+
+    Worker *workers = calloc((size_t)threads, sizeof(Worker));
+    if (!workers) { perror("calloc"); exit(1); }
+    double start = now();
+    for (int i = 0; i < threads; i++) {
+        workers[i].conns = connections / threads + (i < connections % threads);
+        workers[i].seed = 12345u + (unsigned)i;
+        if (pthread_create(&workers[i].tid, NULL, run, &workers[i]) != 0) { perror("pthread_create"); exit(1); }
+    }
+
+    sleep((unsigned)seconds);
+    running = 0;
+
+    unsigned long long total = 0;
+    for (int i = 0; i < threads; i++) {
+        pthread_join(workers[i].tid, NULL);
+        total += workers[i].done;
+    }
+    double elapsed = now() - start;
+
+    printf("requests=%llu seconds=%.2f requests_per_sec=%.0f connections=%d threads=%d depth=%d rules=%d\n",
+           total, elapsed, (double)total / elapsed, connections, threads, depth, rules);
+    return 0;
+}
@@ -0,0 +1,227 @@
+/* Differential test for scan_args, the single-pass parser of the A, C and D arguments in serverCSubmission.c.
+It keeps a copy of the sscanf-based parse_ip, parse_port and parse_rule that scan_args replaced, plus the checks handle_C did before calling them,
+and feeds the same strings to both sides: a list of hand-written edge cases first, then a number of generated ones.
+Every string is tried as a rule (A and D, ranges allowed) and as a check (C, single ip and port) - accept/reject and the parsed values have to agree.
+The engine is included rather than linked so its static scan_args can be called.
+
+Build: gcc -O2 -pthread parseTest.c -o parseTest
+Run:   ./parseTest [generated strings] [seed] */
+
+#include "serverCSubmission.c"
+
+//the parsing as it was before scan_args - kept as it was, apart from the names
+static int old_parse_ip(const char *s, uint32_t *out) {
+    int a, b, c, d;
+    int consumed = 0;
+
+    if (sscanf(s, "%d.%d.%d.%d%n", &a, &b, &c, &d, &consumed) != 4)
+        return 0;
+    if (s[consumed] != '\0')
+        return 0;
+    if (a < 0 || a > 255 || b < 0 || b > 255 ||
+        c < 0 || c > 255 || d < 0 || d > 255)
+        return 0;
+
+    *out = ((uint32_t)a << 24 | (uint32_t)b << 16 |
+            (uint32_t)c << 8 | (uint32_t)d);
+    return 1;
+}
+
+static int old_parse_port(const char *s, int *out) {
+    if (!isdigit((unsigned char) s[0])) return 0;
+
+    int port;
+    int consumed = 0;
+
+    if (sscanf(s, "%d%n", &port, &consumed) != 1)
+        return 0;
+    if (s[consumed] != '\0')
+        return 0;
+    if (port < 0 || port > 65535)
+        return 0;
+
+    *out = port;
+    return 1;
+}
+
+static int old_parse_rule(const char *s, Rule *out) {
+    char ip_part[64], port_part[32];
+
+    const char *sp = strchr(s, ' ');
+    if (!sp) return 0;
+    if (sp != strrchr(s, ' ')) return 0;
+    if (strpbrk(s, "\t\r\n")) return 0;
+
+    if (sscanf(s, "%63s %31s", ip_part, port_part) != 2)
+        return 0;
+
+    char *ip_dash = strchr(ip_part, '-');
+    if (ip_dash) {
+        *ip_dash = '\0';
+        if (!old_parse_ip(ip_part, &out -> ip_start)) return 0;
+        if (!old_parse_ip(ip_dash + 1, &out -> ip_end)) return 0;
+        if (out -> ip_start >= out -> ip_end) return 0;
+    } else {
+        if (!old_parse_ip(ip_part, &out -> ip_start)) return 0;
+        out -> ip_end = out -> ip_start;
+    }
+
+    char *port_dash = strchr(port_part, '-');
+    if (port_dash) {
+        *port_dash = '\0';
+        if (!old_parse_port(port_part, &out -> port_start)) return 0;
+        if (!old_parse_port(port_dash + 1, &out -> port_end)) return 0;
+        if (out -> port_start >= out -> port_end) return 0;
+    } else {
+        if (!old_parse_port(port_part, &out -> port_start)) return 0;
+        out -> port_end = out -> port_start;
+    }
+    return 1;
+}
+
+//what handle_C did with its arguments before calling scan_args
+static int old_parse_check(const char *rest, Rule *out) {
+    if (strpbrk(rest, "\t\r\n"))
+        return 0;
+
+    const char *sp = strchr(rest, ' ');
+    if (!sp || sp != strrchr(rest, ' '))
+        return 0;
+
+    char ip_str[64], port_str[32];
+    if (sscanf(rest, "%63s %31s", ip_str, port_str) != 2)
+        return 0;
+
+    int port;
+    if (!old_parse_ip(ip_str, &out -> ip_start) || !old_parse_port(port_str, &port))
+        return 0;
+    out -> ip_end = out -> ip_start;
+    out -> port_start = out -> port_end = port;
+    return 1;
+}
+
+static long tested, mismatches;
+
+//parses s both ways, as a rule and as a check, and reports any difference
+static void compare(const char *s) {
+    for (int allow_range = 0; allow_range <= 1; allow_range++) {
+        Rule old_r = {0}, new_r = {0};
+        int old_ok = allow_range ? old_parse_rule(s, &old_r) : old_parse_check(s, &old_r);
+        int new_ok = scan_args(s, allow_range, &new_r);
+        tested++;
+        if (old_ok == new_ok && (!old_ok || (old_r.ip_start == new_r.ip_start && old_r.ip_end == new_r.ip_end &&
+                                             old_r.port_start == new_r.port_start && old_r.port_end == new_r.port_end)))
+            continue;
+        if (mismatches++ < 10)
+            printf("mismatch as a %s: \"%s\" - old %d %u-%u %d-%d, scan_args %d %u-%u %d-%d\n", allow_range ? "rule" : "check", s,
+                   old_ok, old_r.ip_start, old_r.ip_end, old_r.port_start, old_r.port_end,
+                   new_ok, new_r.ip_start, new_r.ip_end, new_r.port_start, new_r.port_end);
+    }
+}
+
+static const char *cases[] = {
+    //well-formed
+    "1.2.3.4 80", "0.0.0.0 0", "255.255.255.255 65535", "10.0.0.1-10.0.0.9 20-30", "1.2.3.4-1.2.3.5 80",
+    //width limits - the ip token is cut off after 63 characters and the port token after 31, and the rest of an over-long ip token becomes the port token
+    "000000000000000000000000000000000000000000000000000000001.2.3.4 80",
+    "0000000000000000000000000000000000000000000000000000000001.2.3.4 80",
+    "000000000000000000000000000000000000000000000000000000001.2.3.422 x",
+    "000000000000000000000000000000000000000000000000000000001.2.3.422-23 x",
+    "1.2.3.4 0000000000000000000000000000022345",
+    "1.2.3.4 000000000000000000000000000002234",
+    "1.2.3.4 00000000000000000000000000000000000000080",
+    "1.2.3.4-000000000000000000000000000000000000000000000000001.2.3.5 80",
+    //leading signs
+    "+1.2.3.4 80", "-1.2.3.4 80", "1.+2.3.4 80", "1.-0.3.4 80", "1.2.3.4 +80", "1.2.3.4 -80", "+-1.2.3.4 80",
+    "1.2.3.4--1.2.3.5 80", "1.2.3.4-+1.2.3.5 80", "1.2.3.4-1.2.3.5 80--81", "1.2.3.4 80-+81", "-0.0.0.0-1.0.0.0 1",
+    //leading zeros
+    "01.02.03.04 080", "001.002.003.004 00080", "0000255.0.0.0 1", "1.2.3.4 065535", "1.2.3.4 065536",
+    //overflow - %d goes through strtol and truncates the long to an int
+    "4294967297.0.0.1 80", "4294967296.0.0.1 80", "18446744073709551617.0.0.1 80", "99999999999999999999.0.0.1 80",
+    "-4294967295.0.0.1 80", "1.2.3.4 65536", "1.2.3.4 4294967376", "1.2.3.4 99999999999999999999", "256.0.0.1 80",
+    "1.2.3.4-1.2.3.4294967301 80", "1.2.3.4 80-4295032831",
+    //trailing garbage
+    "1.2.3.4 80x", "1.2.3.4x 80", "1.2.3.4. 80", "1.2.3.4.5 80", "1.2.3.4 80-", "1.2.3.4- 80", "1.2.3.4 80 ", " 1.2.3.4 80",
+    "1.2.3.4 80\t", "1.2.3.4\t80", "1.2.3.4 80\n", "1.2.3.4 8 0", "1.2.3.4 80-81-82", "1.2.3.4-1.2.3.5-1.2.3.6 80",
+    "1.2.3.4\v80", "1.2.3.4 80\f", "1.2.3.4\v 80", "1.2.3.4 \f80",
+    //missing fields
+    "", " ", "1.2.3.4", "1.2.3.4 ", " 80", "1.2.3 80", "1.2.3. 80", "1..3.4 80", ".1.2.3.4 80", "1.2.3.4 -", "1.2.3.4- 80-",
+    "-1.2.3.4 80", "1.2.3.4-", "- 80", "1.2.3.4 .",
+    //ranges that do not go upwards
+    "1.2.3.4-1.2.3.4 80", "1.2.3.5-1.2.3.4 80", "1.2.3.4 80-80", "1.2.3.4 81-80",
+};
+
+static unsigned long long rand_state;
+
+static unsigned rand_next(void) {
+    rand_state ^= rand_state << 13;
+    rand_state ^= rand_state >> 7;
+    rand_state ^= rand_state << 17;
+    return (unsigned)rand_state;
+}
+
+//appends one number the way a slightly wrong client might write it - mostly plain, sometimes signed, zero-padded, huge or empty
+static char *put_number(char *p, unsigned limit) {
+    unsigned k = rand_next() % 20;
+    if (k == 0) *p++ = '+';
+    if (k == 1) *p++ = '-';
+    if (k == 2)
+        for (unsigned z = rand_next() % 70; z; z--)
+            *p++ = '0';
+    if (k == 3)
+        return p + sprintf(p, "%llu", (unsigned long long)rand_next() << (rand_next() % 32) | rand_next());
+    if (k == 4)
+        return p;
+    return p + sprintf(p, "%u", rand_next() % (limit + 2));
+}
+
+//builds a near-valid argument string, then sometimes replaces or inserts a character
+static void generate(char *s) {
+    char *p = s;
+    for (int half = 0; half < 1 + (rand_next() % 3 == 0); half++) {
+        if (half)
+            *p++ = '-';
+        for (int part = 0; part < 4; part++) {
+            if (part)
+                *p++ = '.';
+            p = put_number(p, 255);
+        }
+    }
+    *p++ = ' ';
+    p = put_number(p, 65535);
+    if (rand_next() % 3 == 0) {
+        *p++ = '-';
+        p = put_number(p, 65535);
+    }
+    *p = '\0';
+
+    static const char junk[] = " .-+0123456789x\t\n\r\v\f";
+    size_t len = (size_t)(p - s);
+    for (unsigned edits = rand_next() % 3; edits && len; edits--) {
+        size_t at = rand_next() % len;
+        if (rand_next() % 2) {
+            memmove(s + at + 1, s + at, len - at + 1);
+            len++;
+        }
+        s[at] = junk[rand_next() % (sizeof(junk) - 1)];
+    }
+}
+
+int main(int argc, char **argv) {
+    long generated = argc > 1 ? atol(argv[1]) : 1000000;
+    rand_state = argc > 2 ? strtoull(argv[2], NULL, 10) : 88172645463325252ULL;
+    if (rand_state == 0)
+        rand_state = 1;
+
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+        compare(cases[i]);
+
+    char s[1024];
+    for (long i = 0; i < generated; i++) {
+        generate(s);
+        compare(s);
+    }
+
+    printf("parseTest: %ld parses compared, %ld mismatches\n", tested, mismatches);
+    return mismatches != 0;
+}
@@ -0,0 +1,327 @@
+/* Benchmark harness for the rule engine in serverCSubmission.c - it links the engine directly, so no sockets are involved.
+Each run preloads a number of rules, then has a number of threads send a mix of C, A and D requests through processRequest, timing every one of them.
+Once the threads are done it times one L and one R of whatever the run left behind.
+Every combination of the -r and -t lists runs in its own forked process, so each one starts from an empty engine and reports its own peak RSS.
+Results are printed one line per run as key=value pairs, so they can be diffed or parsed to spot regressions.
+
+-m gives the percentage of C, A and D requests. A and D churn rules of each thread's own (every D removes the oldest rule that thread added), so the rule count stays near -r.
+-h is the fraction of C requests aimed at a preloaded rule - the rest go to addresses no rule covers.
+-z makes C traffic skewed: every C is one of that many fixed ip/port pairs (picked the same way, so -h still holds), instead of a fresh pair each time.
+-k picks the shape of the preloaded rules: cidr (/24 blocks), exact (single addresses), range (blocks that are not CIDR-aligned)
+or v6 (the cidr blocks moved into 2001:db8::/96, so every request takes the IPv6 path - its lookup is a linear scan, so keep -r small).
+
+Build: gcc -O2 -pthread ruleBench.c serverCSubmission.c -o ruleBench
+Run:   ./ruleBench [-r rules,...] [-t threads,...] [-n requests per thread] [-m check/add/delete] [-h hit ratio] [-z hot pairs] [-k cidr|exact|range|v6] [-s seed] */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+extern char *processRequest(char *request);
+
+#define MAX_LIST 32
+#define BUCKETS (16 + (40 - 4 + 1) * 8)  //exact below 16 ns, then 8 buckets per power of 2 - the same layout as the engine's S histograms
+#define CHURN_RING 4096  //rules each thread can have added and not yet deleted
+
+static long rule_counts[MAX_LIST] = { 10, 1000, 100000 };
+static int rule_count_n = 3;
+static long thread_counts[MAX_LIST] = { 1, 4 };
+static int thread_count_n = 2;
+static long requests = 1000000;  //per thread
+static int check_pct = 90, add_pct = 5, delete_pct = 5;
+static double hit_ratio = 0.5;
+static long hot_pairs = 0;  //0 - every C picks a new pair
+static const char *shape = "cidr";
+static unsigned seed = 1;
+
+// Latency is a histogram of request times in ns
+typedef struct {
+    uint64_t buckets[BUCKETS];
+    uint64_t count, max;
+} Latency;
+
+// Worker is one load thread, what it has sent and how long each request took
+typedef struct {
+    pthread_t tid;
+    int id;
+    long rules;  //preloaded rules that C requests can hit
+    unsigned seed;
+    Latency all, check;
+    uint64_t accepted;
+    uint32_t churn[CHURN_RING];  //ips of the rules this thread has added, oldest first from churn_head
+    size_t churn_head, churn_count;
+    uint32_t churn_next;
+} Worker;
+
+static unsigned bucket_of(uint64_t v) {
+    if (v < 16)
+        return (unsigned)v;
+    unsigned e = 63 - (unsigned)__builtin_clzll(v);
+    if (e > 40)
+        return BUCKETS - 1;
+    return 16 + (e - 4) * 8 + (unsigned)(v >> (e - 3) & 7);
+}
+
+static uint64_t bucket_top(unsigned b) {
+    if (b < 16)
+        return b;
+    unsigned e = (b - 16) / 8 + 4, sub = (b - 16) % 8;
+    return ((8ull + sub + 1) << (e - 3)) - 1;
+}
+
+static void latency_record(Latency *h, uint64_t ns) {
+    h -> buckets[bucket_of(ns)]++;
+    h -> count++;
+    if (ns > h -> max)
+        h -> max = ns;
+}
+
+static void latency_merge(Latency *into, const Latency *h) {
+    for (unsigned b = 0; b < BUCKETS; b++)
+        into -> buckets[b] += h -> buckets[b];
+    into -> count += h -> count;
+    if (h -> max > into -> max)
+        into -> max = h -> max;
+}
+
+static uint64_t latency_percentile(const Latency *h, double q) {
+    uint64_t target = (uint64_t)(q * (double)h -> count + 0.999999), seen = 0;
+    for (unsigned b = 0; b < BUCKETS; b++) {
+        seen += h -> buckets[b];
+        if (seen >= target && seen > 0)
+            return bucket_top(b) < h -> max ? bucket_top(b) : h -> max;
+    }
+    return h -> max;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+//with -k v6 every address is written as 2001:db8:: followed by the 32 bits of ip
+static int format_ip(char *out, uint32_t ip) {
+    if (strcmp(shape, "v6") == 0)
+        return sprintf(out, "2001:db8::%x:%x", ip >> 16, ip & 0xffff);
+    return sprintf(out, "%u.%u.%u.%u", ip >> 24, ip >> 16 & 255, ip >> 8 & 255, ip & 255);
+}
+
+//writes the "<ip>[-<ip>] <ports>" arguments of the rule in the /24 starting at base, in the shape picked with -k
+static void rule_args(char *out, uint32_t base) {
+    char a[40], b[40];
+    if (strcmp(shape, "exact") == 0) {
+        format_ip(a, base + 7);
+        sprintf(out, "%s 1-1024", a);
+    } else if (strcmp(shape, "range") == 0) {
+        format_ip(a, base + 3);
+        format_ip(b, base + 203);
+        sprintf(out, "%s-%s 1-1024", a, b);
+    } else {
+        format_ip(a, base);
+        format_ip(b, base + 255);
+        sprintf(out, "%s-%s 1-1024", a, b);
+    }
+}
+
+//an address inside the rule whose block starts at base
+static uint32_t rule_hit(uint32_t base, unsigned *s) {
+    if (strcmp(shape, "exact") == 0)
+        return base + 7;
+    if (strcmp(shape, "range") == 0)
+        return base + 3 + rand_r(s) % 201;
+    return base + rand_r(s) % 256;
+}
+
+//preloaded rule k covers part of the /24 at 10.0.0.0 + k * 256, churn rules live at 176.0.0.0 and up, and misses go to 192.0.0.0 and up
+static uint32_t preload_base(long k) {
+    return 0x0A000000u + (uint32_t)k * 256;
+}
+
+static uint32_t churn_base(int thread, uint32_t j) {
+    return 0xB0000000u + ((uint32_t)thread << 20) + (j % 4096) * 256;
+}
+
+static void send_request(Worker *w, char *request, int is_check) {
+    uint64_t start = now_ns();
+    char *response = processRequest(request);
+    uint64_t ns = now_ns() - start;
+    latency_record(&w -> all, ns);
+    if (is_check) {
+        latency_record(&w -> check, ns);
+        w -> accepted += response[11] == 'a';  //"Connection accepted" rather than "Connection rejected"
+    }
+    free(response);
+}
+
+static void *run(void *arg) {
+    Worker *w = arg;
+    char request[96];
+    for (long i = 0; i < requests; i++) {
+        int pick = (int)(rand_r(&w -> seed) % 100);
+        if (pick < check_pct) {
+            //with -z the pair is drawn from a seed fixed by which hot pair it is, so every thread sends the same few pairs over and over
+            unsigned hot = hot_pairs > 0 ? seed * 2654435761u + (unsigned)(rand_r(&w -> seed) % hot_pairs) * 40503u : 0;
+            unsigned *s = hot_pairs > 0 ? &hot : &w -> seed;
+            uint32_t ip;
+            if (w -> rules > 0 && rand_r(s) < hit_ratio * ((double)RAND_MAX + 1))
+                ip = rule_hit(preload_base(rand_r(s) % w -> rules), s);
+            else
+                ip = 0xC0000000u + rand_r(s) % 0x1000000;
+            int len = sprintf(request, "C ");
+            len += format_ip(request + len, ip);
+            sprintf(request + len, " %u", 1 + rand_r(s) % 1024);
+            send_request(w, request, 1);
+        } else if (w -> churn_count == 0 || (pick < check_pct + add_pct && w -> churn_count < CHURN_RING)) {  //a D needs a rule to delete, an A needs room to remember its rule
+            uint32_t base = churn_base(w -> id, w -> churn_next++);
+            request[0] = 'A';
+            request[1] = ' ';
+            rule_args(request + 2, base);
+            send_request(w, request, 0);
+            w -> churn[(w -> churn_head + w -> churn_count++) % CHURN_RING] = base;
+        } else {
+            request[0] = 'D';
+            request[1] = ' ';
+            rule_args(request + 2, w -> churn[w -> churn_head]);
+            send_request(w, request, 0);
+            w -> churn_head = (w -> churn_head + 1) % CHURN_RING;
+            w -> churn_count--;
+        }
+    }
+    return NULL;
+}
+
+//times one L or R and reports the size of its output
+static void dump(const char *kind, size_t *bytes, double *ms) {
+    char request[2] = { kind[0], '\0' };
+    uint64_t start = now_ns();
+    char *response = processRequest(request);
+    *ms = (double)(now_ns() - start) / 1e6;
+    *bytes = strlen(response);
+    free(response);
+}
+
+//one run - called in a child process so it starts from an empty engine and its peak RSS is its own
+static void bench(long rules, int threads) {
+    char request[96];
+    for (long k = 0; k < rules; k++) {
+        request[0] = 'A';
+        request[1] = ' ';
+        rule_args(request + 2, preload_base(k));
+        free(processRequest(request));
+    }
+
+    Worker *workers = calloc((size_t)threads, sizeof(Worker));
+    if (!workers) { perror("calloc"); exit(1); }
+    uint64_t start = now_ns();
+    for (int i = 0; i < threads; i++) {
+        workers[i].id = i;
+        workers[i].rules = rules;
+        workers[i].seed = seed * 2654435761u + (unsigned)i;
+        if (pthread_create(&workers[i].tid, NULL, run, &workers[i]) != 0) { perror("pthread_create"); exit(1); }
+    }
+    Latency *all = calloc(1, sizeof(Latency)), *check = calloc(1, sizeof(Latency));
+    if (!all || !check) { perror("calloc"); exit(1); }
+    uint64_t accepted = 0;
+    for (int i = 0; i < threads; i++) {
+        pthread_join(workers[i].tid, NULL);
+        latency_merge(all, &workers[i].all);
+        latency_merge(check, &workers[i].check);
+        accepted += workers[i].accepted;
+    }
+    double seconds = (double)(now_ns() - start) / 1e9;
+
+    size_t l_bytes, r_bytes;
+    double l_ms, r_ms;
+    dump("L", &l_bytes, &l_ms);
+    dump("R", &r_bytes, &r_ms);
+
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    printf("rules=%ld threads=%d shape=%s mix=%d/%d/%d hit=%.2f hot=%ld requests=%llu seconds=%.3f requests_per_sec=%.0f "
+           "p50_ns=%llu p99_ns=%llu p999_ns=%llu max_ns=%llu check_p50_ns=%llu check_p99_ns=%llu check_p999_ns=%llu accepted=%llu "
+           "l_bytes=%zu l_ms=%.2f r_bytes=%zu r_ms=%.2f peak_rss_kb=%ld\n",
+           rules, threads, shape, check_pct, add_pct, delete_pct, hit_ratio, hot_pairs, (unsigned long long)all -> count, seconds, (double)all -> count / seconds,
+           (unsigned long long)latency_percentile(all, 0.5), (unsigned long long)latency_percentile(all, 0.99),
+           (unsigned long long)latency_percentile(all, 0.999), (unsigned long long)all -> max,
+           (unsigned long long)latency_percentile(check, 0.5), (unsigned long long)latency_percentile(check, 0.99),
+           (unsigned long long)latency_percentile(check, 0.999), (unsigned long long)accepted,
+           l_bytes, l_ms, r_bytes, r_ms, ru.ru_maxrss);
+    fflush(stdout);
+    free(all);
+    free(check);
+    free(workers);
+}
+
+//reads a comma-separated list of positive numbers such as "10,1000,1000000"
+static int parse_list(const char *s, long *out) {
+    int n = 0;
+    while (*s && n < MAX_LIST) {
+        char *end;
+        long v = strtol(s, &end, 10);
+        if (end == s || v < 0)
+            return 0;
+        out[n++] = v;
+        s = *end == ',' ? end + 1 : end;
+        if (*end && *end != ',')
+            return 0;
+    }
+    return n;
+}
+
+int main(int argc, char **argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "r:t:n:m:h:z:k:s:")) != -1) {
+        switch (opt) {
+            case 'r': rule_count_n = parse_list(optarg, rule_counts); break;
+            case 't': thread_count_n = parse_list(optarg, thread_counts); break;
+            case 'n': requests = atol(optarg); break;
+            case 'm':
+                if (sscanf(optarg, "%d/%d/%d", &check_pct, &add_pct, &delete_pct) != 3 || check_pct < 0 || add_pct < 0 || delete_pct < 0 ||
+                    check_pct + add_pct + delete_pct != 100) {
+                    fprintf(stderr, "-m wants check/add/delete percentages adding up to 100, such as 90/5/5\n");
+                    return 1;
+                }
+                break;
+            case 'h': hit_ratio = atof(optarg); break;
+            case 'z': hot_pairs = atol(optarg); break;
+            case 'k': shape = optarg; break;
+            case 's': seed = (unsigned)atoi(optarg); break;
+            default:
+                fprintf(stderr, "usage: %s [-r rules,...] [-t threads,...] [-n requests per thread] [-m check/add/delete] [-h hit ratio] [-z hot pairs] [-k cidr|exact|range|v6] [-s seed]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (rule_count_n == 0 || thread_count_n == 0) {
+        fprintf(stderr, "-r and -t want comma-separated lists of numbers\n");
+        return 1;
+    }
+    if (strcmp(shape, "cidr") != 0 && strcmp(shape, "exact") != 0 && strcmp(shape, "range") != 0 && strcmp(shape, "v6") != 0) {
+        fprintf(stderr, "unknown rule shape %s - expected cidr, exact, range or v6\n", shape);
+        return 1;
+    }
+
+    for (int r = 0; r < rule_count_n; r++) {
+        for (int t = 0; t < thread_count_n; t++) {
+            int threads = thread_counts[t] < 1 ? 1 : (int)thread_counts[t];
+            pid_t pid = fork();
+            if (pid < 0) { perror("fork"); exit(1); }
+            if (pid == 0) {
+                bench(rule_counts[r], threads);
+                _exit(0);
+            }
+            int status;
+            waitpid(pid, &status, 0);
+            if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+                fprintf(stderr, "run with %ld rules and %d threads failed\n", rule_counts[r], threads);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,854 @@
+/* TCP front-end for the rule engine in serverCSubmission.c.
+Clients send one request per line ("C 147.188.192.43 22\n") and get one response per request, each followed by '\n'. Requests can be pipelined - responses always come back in order.
+Pipelined lines that arrive together are run as one batch with processBatch, which takes the engine's locks once per run of reads or writes rather than once per line.
+Text requests take IPv6 addresses as well ("A 2001:db8::-2001:db8::ffff 443\n"), and L lists them in RFC 5952 form. L prints every rule as "Rule: <ip> <port>", with a space before the port. Binary frames are IPv4 only.
+C, A and D can also be sent as binary frames (see processBinary in serverCSubmission.c), which are answered with a single status byte and no '\n'. Both kinds can be mixed on one connection.
+
+Each worker thread has its own listening socket bound to the same port with SO_REUSEPORT, so the kernel spreads new connections over the workers.
+Workers run on io_uring (multishot accept and recv into provided buffers, batched sends) when the kernel supports it (6.0 or later), and otherwise on an edge-triggered epoll loop. -m epoll forces the epoll loop.
+
+With -s, the rules, query history and request log are restored from that snapshot file at startup (if it exists), saved to it on SIGUSR1, and saved to it once more on SIGTERM or SIGINT before the server exits.
+With -w, every change to the rules is also recorded in that write-ahead log before it is answered, and replayed on top of the snapshot at startup. -g sets how many microseconds a change waits for others to share its fdatasync (default 0).
+With -l, the rules in that file (one per line, in the same form as an A request with or without the "A ") are added with loadRules before the server starts listening. The load is all-or-nothing - one bad line and the server exits naming it. It is meant for a first start: with -w or -s the loaded rules are kept, so loading the file again on a restart would add them twice.
+
+S replies with per-command latency histograms, rules_lock and shard lock wait and hold times, C scan lengths, allocation counts and decision cache hits and misses, summed over every thread. Add -DNO_STATS to the build to compile that instrumentation out.
+
+Build: gcc -O2 -pthread ruleServer.c serverCSubmission.c -o ruleServer
+Run:   ./ruleServer [-p port] [-t threads] [-m uring|epoll] [-s snapshot] [-w wal] [-g group commit usec] [-l rules file]
+Compare the two transports with benchTransports.sh. */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <limits.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+extern const char *processRequestInto(const char *request, size_t len, char *buf, size_t cap);
+extern size_t binaryFrameLength(uint8_t opcode);
+extern uint8_t processBinary(const uint8_t *frame);
+extern char *processBatch(const char *requests, size_t len, size_t *out_len);
+extern struct Listing *openListing(const char *request, size_t len);
+extern size_t readListing(struct Listing *l, char *buf, size_t cap);
+extern void closeListing(struct Listing *l);
+extern int saveSnapshot(const char *path);
+extern int loadSnapshot(const char *path);
+extern int openWal(const char *path, unsigned window_us);
+extern int loadRulesFile(const char *path, size_t *bad_line);
+
+#define READ_CHUNK 16384
+#define MAX_EVENTS 256
+#define MAX_LINE (1 << 20)  //connections sending a longer line than this without a '\n' are dropped
+#define MAX_HELD (16 << 20)  //connections sending more than this while an L or R is still being written to them are dropped
+#define LISTING_CHUNK 65536  //L and R output is read from the engine this much at a time
+
+// Pending is one piece of output waiting to be written - either a static reply from the engine or an L/R listing
+typedef struct {
+    const char *base;
+    size_t len;
+    char *owned;  //freed once the piece has been written, NULL for static replies
+    struct Listing *listing;  //L/R output still being read - owned holds the part read so far, and is refilled once that has been written
+} Pending;
+
+// Conn is the state kept for each client connection
+typedef struct {
+    int fd;
+    char *in;  //bytes read but not yet processed (a partial line)
+    size_t in_len, in_cap;
+    Pending *out;  //responses waiting to be written, in order
+    size_t out_head, out_count, out_cap;  //out[out_head .. out_count) are still to be written
+    size_t out_off;  //bytes of out[out_head] already written
+    int held;  //an L or R is still being written - the requests after it wait, so they cannot change what it lists
+    int resumed;  //the held requests have just run - epoll mode reads the socket again
+    int closing;  //the client hung up or the connection failed - free it once its output is written and, in io_uring mode, the kernel has let go of it
+
+    //io_uring mode only - the kernel owns iov and msg while a send is in flight
+    struct iovec *iov;
+    struct msghdr msg;
+    int reading;  //a multishot recv is armed
+    int sending;  //a send is in flight
+    int queued;  //on the worker's list of connections to send for
+    int failed;  //drop any output still queued
+} Conn;
+
+static int port = 8080;
+static char byte_values[256];  //byte_values[b] == b - binary status bytes are queued as pointers into this
+
+static int open_listener(void) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (fd < 0) { perror("socket"); exit(1); }
+
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0) { perror("setsockopt SO_REUSEPORT"); exit(1); }  //lets every worker bind its own socket to the same port
+
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons((uint16_t)port);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) { perror("bind"); exit(1); }
+    if (listen(fd, SOMAXCONN) < 0) { perror("listen"); exit(1); }
+    return fd;
+}
+
+static void push_piece(Conn *c, Pending piece) {
+    if (c -> out_count == c -> out_cap) {
+        if (c -> out_head > 0) {  //reuse the space of pieces already written before growing
+            memmove(c -> out, c -> out + c -> out_head, (c -> out_count - c -> out_head) * sizeof(Pending));
+            c -> out_count -= c -> out_head;
+            c -> out_head = 0;
+        }
+        if (c -> out_count == c -> out_cap) {
+            size_t new_cap = c -> out_cap ? c -> out_cap * 2 : 64;
+            Pending *tmp = realloc(c -> out, new_cap * sizeof(Pending));
+            if (!tmp) { perror("realloc"); exit(1); }
+            c -> out = tmp;
+            c -> out_cap = new_cap;
+        }
+    }
+    c -> out[c -> out_count++] = piece;
+}
+
+static void push_output(Conn *c, const char *base, size_t len, char *owned) {
+    push_piece(c, (Pending){ base, len, owned, NULL });
+}
+
+//queues an L, R or S listing - its output is read from the engine a chunk at a time as the socket takes it
+//the connection is held until the listing is finished
+static void push_listing(Conn *c, struct Listing *l) {
+    char *chunk = malloc(LISTING_CHUNK);
+    if (!chunk) { perror("malloc"); exit(1); }
+    push_piece(c, (Pending){ chunk, 0, chunk, l });
+    c -> held = 1;
+}
+
+//runs one request line and queues its response followed by '\n'
+static void handle_line(Conn *c, char *line, size_t len) {
+    if (len > 0 && line[len - 1] == '\r')  //accept "\r\n" line endings from telnet-style clients
+        len--;
+
+    struct Listing *l = openListing(line, len);
+    if (l) {
+        //L, R and S can be any size, so they are streamed in chunks rather than built in memory all at once
+        push_listing(c, l);
+    } else {
+        //every other command replies with a static string, so nothing is copied or allocated
+        const char *response = processRequestInto(line, len, NULL, 0);
+        push_output(c, response, strlen(response), NULL);
+    }
+    push_output(c, "\n", 1, NULL);
+}
+
+//L, R and S lines (without their '\n') are streamed by handle_line, so they are never part of a batch
+static int is_listing(const char *line, size_t len) {
+    if (len > 0 && line[len - 1] == '\r')
+        len--;
+    len = strnlen(line, len);
+    return len == 1 && (line[0] == 'L' || line[0] == 'R' || line[0] == 'S');
+}
+
+//drops every piece of queued output covered by the first written bytes
+static void out_advance(Conn *c, size_t written) {
+    while (written > 0) {
+        Pending *p = &c -> out[c -> out_head];
+        size_t rest = p -> len - c -> out_off;
+        if (written < rest) {
+            c -> out_off += written;
+            return;
+        }
+        written -= rest;
+        if (p -> listing) {  //the chunk is written but the listing goes on - out_prepare reads the next one
+            c -> out_off = p -> len;
+            return;
+        }
+        free(p -> owned);
+        c -> out_head++;
+        c -> out_off = 0;
+    }
+    if (c -> out_head == c -> out_count)
+        c -> out_head = c -> out_count = 0;
+}
+
+//points up to max iovecs at the queued output, skipping what was already written of the first piece
+//stops at a listing - only the chunk it has read so far can be written, and only once it is at the head of the queue
+static int fill_iov(Conn *c, struct iovec *iov, int max) {
+    int n = 0;
+    for (size_t k = c -> out_head; k < c -> out_count && n < max; k++) {
+        if (c -> out[k].listing && k != c -> out_head)
+            break;
+        size_t skip = k == c -> out_head ? c -> out_off : 0;
+        iov[n].iov_base = (void *)(c -> out[k].base + skip);
+        iov[n].iov_len = c -> out[k].len - skip;
+        n++;
+        if (c -> out[k].listing)
+            break;
+    }
+    return n;
+}
+
+//runs every complete request in data[0 .. n) - text lines and binary frames can be mixed, and a frame is binary when its first byte is a binary opcode
+//from is where the bytes not seen before begin, so a partial text line is not searched for '\n' twice
+//returns how many bytes were used up - the rest is the start of an incomplete request
+static size_t run_requests(Conn *c, char *data, size_t n, size_t from) {
+    size_t start = 0;
+    while (start < n && !c -> held) {
+        size_t need = binaryFrameLength((uint8_t)data[start]);
+        if (need) {
+            if (n - start < need)
+                break;
+            uint8_t status = processBinary((const uint8_t *)data + start);
+            push_output(c, &byte_values[status], 1, NULL);
+            start += need;
+            continue;
+        }
+
+        size_t scan = start > from ? start : from;
+        char *nl = memchr(data + scan, '\n', n - scan);
+        if (!nl)
+            break;
+        size_t end = (size_t)(nl - data) + 1;
+        if (is_listing(data + start, end - 1 - start)) {
+            handle_line(c, data + start, end - 1 - start);
+            start = end;
+            continue;
+        }
+
+        //the complete lines that follow, up to the next binary frame or listing, run as one batch - the engine then locks once per run of them, not once per line
+        size_t lines = 1;
+        while (end < n && !binaryFrameLength((uint8_t)data[end])) {
+            char *next = memchr(data + end, '\n', n - end);
+            if (!next || is_listing(data + end, (size_t)(next - data) - end))
+                break;
+            end = (size_t)(next - data) + 1;
+            lines++;
+        }
+        if (lines == 1) {
+            handle_line(c, data + start, end - 1 - start);  //a lone line needs no allocation
+        } else {
+            size_t out_len;
+            char *out = processBatch(data + start, end - start, &out_len);
+            push_output(c, out, out_len, out);
+        }
+        start = end;
+    }
+    return start;
+}
+
+//runs every complete request in c -> in from byte from onwards and keeps the incomplete last one (or, while held, everything not run yet) for later
+//returns 0 if a partial line or the held requests have grown too long
+static int run_buffered(Conn *c, size_t from) {
+    size_t start = run_requests(c, c -> in, c -> in_len, from);
+    memmove(c -> in, c -> in + start, c -> in_len - start);
+    c -> in_len -= start;
+    return c -> in_len <= (c -> held ? MAX_HELD : MAX_LINE);
+}
+
+static void reserve_input(Conn *c, size_t need) {
+    if (c -> in_cap - c -> in_len >= need)
+        return;
+    size_t new_cap = c -> in_cap ? c -> in_cap * 2 : READ_CHUNK * 2;
+    while (new_cap - c -> in_len < need)
+        new_cap *= 2;
+    char *tmp = realloc(c -> in, new_cap);
+    if (!tmp) { perror("realloc"); exit(1); }
+    c -> in = tmp;
+    c -> in_cap = new_cap;
+}
+
+//gets the head of the output queue ready to write: a listing whose last chunk has been written reads its next one,
+//and once a listing is finished the requests held behind it are run
+//returns 0 if the connection failed
+static int out_prepare(Conn *c) {
+    while (c -> out_head < c -> out_count) {
+        Pending *p = &c -> out[c -> out_head];
+        if (!p -> listing || c -> out_off < p -> len)
+            return 1;
+        size_t n = readListing(p -> listing, p -> owned, LISTING_CHUNK);
+        if (n > 0) {
+            p -> len = n;
+            c -> out_off = 0;
+            return 1;
+        }
+
+        closeListing(p -> listing);
+        free(p -> owned);
+        c -> out_head++;
+        c -> out_off = 0;
+        c -> held = 0;
+        c -> resumed = 1;
+        if (!run_buffered(c, 0))  //may queue more output, and even another listing
+            return 0;
+    }
+    c -> out_head = c -> out_count = 0;
+    return 1;
+}
+
+//writes as much queued output as the socket will take, with one writev per IOV_MAX pieces
+//returns 0 if the connection failed
+static int flush_output(Conn *c) {
+    for (;;) {
+        if (!out_prepare(c))
+            return 0;
+        if (c -> out_head == c -> out_count)
+            return 1;
+        struct iovec iov[IOV_MAX];
+        int n = fill_iov(c, iov, IOV_MAX);
+        ssize_t written = writev(c -> fd, iov, n);
+        if (written < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 1;  //socket buffer full - EPOLLOUT will tell us when to carry on
+            if (errno == EINTR)
+                continue;
+            return 0;
+        }
+        out_advance(c, (size_t)written);
+    }
+}
+
+//reads until the socket is drained (edge-triggered epoll only reports new data once) and runs every complete line
+//stops early while an L or R is held up waiting for the socket - the rest is read once it has been written
+//returns 0 if the connection closed or failed
+static int read_input(Conn *c) {
+    c -> resumed = 0;
+    while (!c -> held) {
+        reserve_input(c, READ_CHUNK);
+        ssize_t n = read(c -> fd, c -> in + c -> in_len, c -> in_cap - c -> in_len - 1);
+        if (n == 0)
+            return 0;
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 1;
+            if (errno == EINTR)
+                continue;
+            return 0;
+        }
+        size_t from = c -> in_len;
+        c -> in_len += (size_t)n;
+        if (!run_buffered(c, from))
+            return 0;
+    }
+    return 1;
+}
+
+static void close_conn(Conn *c) {
+    close(c -> fd);
+    for (size_t k = c -> out_head; k < c -> out_count; k++) {
+        if (c -> out[k].listing)
+            closeListing(c -> out[k].listing);
+        free(c -> out[k].owned);
+    }
+    free(c -> out);
+    free(c -> in);
+    free(c -> iov);
+    free(c);
+}
+
+static void *epoll_worker(void *arg) {
+    (void)arg;
+    int listen_fd = open_listener();
+    int ep = epoll_create1(0);
+    if (ep < 0) { perror("epoll_create1"); exit(1); }
+
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLET, .data.ptr = NULL };  //data.ptr NULL marks the listening socket
+    if (epoll_ctl(ep, EPOLL_CTL_ADD, listen_fd, &ev) < 0) { perror("epoll_ctl"); exit(1); }
+
+    struct epoll_event events[MAX_EVENTS];
+    for (;;) {
+        int n = epoll_wait(ep, events, MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait");
+            exit(1);
+        }
+
+        for (int k = 0; k < n; k++) {
+            Conn *c = events[k].data.ptr;
+
+            if (!c) {  //new connections - accept until there are none left
+                for (;;) {
+                    int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK);
+                    if (fd < 0)
+                        break;
+                    int one = 1;
+                    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+                    Conn *nc = calloc(1, sizeof(Conn));
+                    if (!nc) { perror("calloc"); exit(1); }
+                    nc -> fd = fd;
+                    struct epoll_event cev = { .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, .data.ptr = nc };
+                    if (epoll_ctl(ep, EPOLL_CTL_ADD, fd, &cev) < 0) { close_conn(nc); continue; }
+                }
+                continue;
+            }
+
+            int ok;
+            int readable = (events[k].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) != 0;
+            do {
+                if (!c -> held && !c -> closing && (readable || c -> resumed))
+                    c -> closing = !read_input(c);
+                ok = flush_output(c);  //one writev covers every response produced by this batch of input - also sent when the client has just hung up
+            } while (ok && !c -> closing && c -> resumed);  //a listing finished and let the held requests run - read whatever arrived meanwhile
+            //a client that has hung up still gets every response - EPOLLOUT comes back here until they have all been written
+            if (!ok || (c -> closing && !c -> held && c -> out_head == c -> out_count))
+                close_conn(c);  //closing the fd also removes it from the epoll set
+        }
+    }
+    return NULL;
+}
+
+// io_uring transport
+// Each worker owns a ring with one multishot accept on its listening socket and one multishot recv per connection.
+// Received bytes land in a ring of provided buffers, which go straight back to the kernel once their lines have run.
+// The sends produced by a batch of completions are all submitted by the same io_uring_enter that waits for the next batch.
+
+#define RING_ENTRIES 1024
+#define BUF_COUNT 512  //provided receive buffers per worker - a power of two
+#define BUF_SIZE 4096
+#define SEND_IOV 256  //pieces covered by one sendmsg
+#define BUF_GROUP 0
+
+//user_data is the Conn pointer with the kind of operation in its low bits (calloc keeps them clear)
+#define TAG_ACCEPT 0
+#define TAG_RECV 1
+#define TAG_SEND 2
+#define TAG_MASK 3
+
+// Ring is one worker's io_uring and its provided buffer ring
+typedef struct {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned sq_entries;
+    unsigned sqe_tail;  //local tail - published when submitting
+    unsigned to_submit;
+    void *rings;
+    size_t rings_size;
+    struct io_uring_buf_ring *br;
+    char *bufs;
+} Ring;
+
+static int uring_setup(unsigned entries, struct io_uring_params *p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static unsigned load_acquire(unsigned *p) {
+    return atomic_load_explicit((_Atomic unsigned *)p, memory_order_acquire);
+}
+
+static void store_release(unsigned *p, unsigned v) {
+    atomic_store_explicit((_Atomic unsigned *)p, v, memory_order_release);
+}
+
+//maps the submission and completion queues of a fresh ring
+//returns 0 if the kernel refused the ring
+static int ring_init(Ring *r, unsigned entries) {
+    struct io_uring_params p = {0};
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = entries * 8;  //every connection can have a recv and a send completion waiting
+    r -> fd = uring_setup(entries, &p);
+    if (r -> fd < 0)
+        return 0;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)) { close(r -> fd); return 0; }
+
+    size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    size_t size = sq_size > cq_size ? sq_size : cq_size;
+    char *rings = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r -> fd, IORING_OFF_SQ_RING);
+    if (rings == MAP_FAILED) { close(r -> fd); return 0; }
+    r -> sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r -> fd, IORING_OFF_SQES);
+    if (r -> sqes == MAP_FAILED) { munmap(rings, size); close(r -> fd); return 0; }
+    r -> rings = rings;
+    r -> rings_size = size;
+
+    r -> sq_head = (unsigned *)(rings + p.sq_off.head);
+    r -> sq_tail = (unsigned *)(rings + p.sq_off.tail);
+    r -> sq_mask = (unsigned *)(rings + p.sq_off.ring_mask);
+    r -> sq_array = (unsigned *)(rings + p.sq_off.array);
+    r -> cq_head = (unsigned *)(rings + p.cq_off.head);
+    r -> cq_tail = (unsigned *)(rings + p.cq_off.tail);
+    r -> cq_mask = (unsigned *)(rings + p.cq_off.ring_mask);
+    r -> cqes = (struct io_uring_cqe *)(rings + p.cq_off.cqes);
+    r -> sq_entries = p.sq_entries;
+    r -> sqe_tail = *r -> sq_tail;
+    r -> to_submit = 0;
+    return 1;
+}
+
+//registers BUF_COUNT receive buffers as buffer group BUF_GROUP
+//returns 0 if the kernel has no provided buffer rings
+static int ring_add_buffers(Ring *r) {
+    size_t ring_size = BUF_COUNT * sizeof(struct io_uring_buf);
+    r -> br = mmap(NULL, ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (r -> br == MAP_FAILED)
+        return 0;
+    struct io_uring_buf_reg reg = {0};
+    reg.ring_addr = (uint64_t)(uintptr_t)r -> br;
+    reg.ring_entries = BUF_COUNT;
+    reg.bgid = BUF_GROUP;
+    if (uring_register(r -> fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        munmap(r -> br, ring_size);
+        return 0;
+    }
+
+    r -> bufs = malloc((size_t)BUF_COUNT * BUF_SIZE);
+    if (!r -> bufs) { perror("malloc"); exit(1); }
+    for (unsigned k = 0; k < BUF_COUNT; k++) {
+        struct io_uring_buf *b = &r -> br -> bufs[k];
+        b -> addr = (uint64_t)(uintptr_t)(r -> bufs + (size_t)k * BUF_SIZE);
+        b -> len = BUF_SIZE;
+        b -> bid = (uint16_t)k;
+    }
+    atomic_store_explicit((_Atomic uint16_t *)&r -> br -> tail, (uint16_t)BUF_COUNT, memory_order_release);
+    return 1;
+}
+
+//hands buffer bid back to the kernel
+static void ring_return_buffer(Ring *r, unsigned bid) {
+    uint16_t tail = r -> br -> tail;
+    struct io_uring_buf *b = &r -> br -> bufs[tail & (BUF_COUNT - 1)];
+    b -> addr = (uint64_t)(uintptr_t)(r -> bufs + (size_t)bid * BUF_SIZE);
+    b -> len = BUF_SIZE;
+    b -> bid = (uint16_t)bid;
+    atomic_store_explicit((_Atomic uint16_t *)&r -> br -> tail, (uint16_t)(tail + 1), memory_order_release);
+}
+
+//submits everything queued so far and waits for at least wait completions
+static void ring_submit(Ring *r, unsigned wait) {
+    store_release(r -> sq_tail, r -> sqe_tail);
+    for (;;) {
+        int n = uring_enter(r -> fd, r -> to_submit, wait, wait ? IORING_ENTER_GETEVENTS : 0);
+        if (n >= 0) {
+            r -> to_submit -= (unsigned)n;
+            if (r -> to_submit == 0 || wait)
+                return;
+            continue;
+        }
+        if (errno == EINTR)
+            continue;
+        if (errno == EAGAIN || errno == EBUSY)
+            return;  //completion queue backed up - the caller reaps and submits again
+        perror("io_uring_enter");
+        exit(1);
+    }
+}
+
+static struct io_uring_sqe *ring_get_sqe(Ring *r) {
+    while (r -> sqe_tail - load_acquire(r -> sq_head) == r -> sq_entries)
+        ring_submit(r, 0);  //submission queue full - hand it to the kernel first
+    unsigned idx = r -> sqe_tail & *r -> sq_mask;
+    struct io_uring_sqe *sqe = &r -> sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    r -> sq_array[idx] = idx;
+    r -> sqe_tail++;
+    r -> to_submit++;
+    return sqe;
+}
+
+static void arm_accept(Ring *r, int listen_fd) {
+    struct io_uring_sqe *sqe = ring_get_sqe(r);
+    sqe -> opcode = IORING_OP_ACCEPT;
+    sqe -> fd = listen_fd;
+    sqe -> ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe -> user_data = TAG_ACCEPT;
+}
+
+static void arm_recv(Ring *r, Conn *c) {
+    struct io_uring_sqe *sqe = ring_get_sqe(r);
+    sqe -> opcode = IORING_OP_RECV;
+    sqe -> fd = c -> fd;
+    sqe -> ioprio = IORING_RECV_MULTISHOT;
+    sqe -> flags = IOSQE_BUFFER_SELECT;
+    sqe -> buf_group = BUF_GROUP;
+    sqe -> user_data = (uint64_t)(uintptr_t)c | TAG_RECV;
+    c -> reading = 1;
+}
+
+static void arm_send(Ring *r, Conn *c) {
+    if (!c -> iov) {
+        c -> iov = malloc(SEND_IOV * sizeof(struct iovec));
+        if (!c -> iov) { perror("malloc"); exit(1); }
+    }
+    memset(&c -> msg, 0, sizeof(c -> msg));
+    c -> msg.msg_iov = c -> iov;
+    c -> msg.msg_iovlen = (size_t)fill_iov(c, c -> iov, SEND_IOV);
+
+    struct io_uring_sqe *sqe = ring_get_sqe(r);
+    sqe -> opcode = IORING_OP_SENDMSG;
+    sqe -> fd = c -> fd;
+    sqe -> addr = (uint64_t)(uintptr_t)&c -> msg;
+    sqe -> msg_flags = MSG_NOSIGNAL;
+    sqe -> user_data = (uint64_t)(uintptr_t)c | TAG_SEND;
+    c -> sending = 1;
+}
+
+//frees a closing connection once the kernel holds no operation on it and nothing is left to send
+static void maybe_close(Conn *c) {
+    if (!c -> closing || c -> reading || c -> sending || c -> queued)
+        return;
+    if (!c -> failed && c -> out_head < c -> out_count)
+        return;
+    close_conn(c);
+}
+
+//stops a connection - shutdown makes its multishot recv finish, so its completions still come back to free it
+static void fail_conn(Conn *c) {
+    if (!c -> failed)
+        shutdown(c -> fd, SHUT_RDWR);
+    c -> failed = 1;
+    c -> closing = 1;
+}
+
+//runs every complete request in n received bytes - requests that arrive whole are run straight from the receive buffer
+//returns 0 if a partial line has grown too long
+static int take_input(Conn *c, char *data, size_t n) {
+    if (c -> in_len == 0) {
+        size_t start = run_requests(c, data, n, 0);
+        data += start;
+        n -= start;
+        if (n == 0)
+            return 1;
+    }
+    reserve_input(c, n + 1);
+    memcpy(c -> in + c -> in_len, data, n);
+    size_t from = c -> in_len;
+    c -> in_len += n;
+    return run_buffered(c, from);
+}
+
+static void *uring_worker(void *arg) {
+    (void)arg;
+    int listen_fd = open_listener();
+    Ring r;
+    if (!ring_init(&r, RING_ENTRIES) || !ring_add_buffers(&r)) { fprintf(stderr, "io_uring setup failed\n"); exit(1); }
+
+    Conn **dirty = NULL;  //connections with new output, sent for once the current batch of completions is handled
+    size_t dirty_count = 0, dirty_cap = 0;
+
+    arm_accept(&r, listen_fd);
+    for (;;) {
+        ring_submit(&r, 1);  //one syscall submits every send and re-arm from the last batch and waits for the next
+
+        unsigned head = *r.cq_head;
+        unsigned tail = load_acquire(r.cq_tail);
+        for (; head != tail; head++) {
+            struct io_uring_cqe *cqe = &r.cqes[head & *r.cq_mask];
+            int tag = (int)(cqe -> user_data & TAG_MASK);
+            Conn *c = (Conn *)(uintptr_t)(cqe -> user_data & ~(uint64_t)TAG_MASK);
+            int res = cqe -> res;
+            int more = cqe -> flags & IORING_CQE_F_MORE;
+
+            if (tag == TAG_ACCEPT) {
+                if (res >= 0) {
+                    int one = 1;
+                    setsockopt(res, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+                    Conn *nc = calloc(1, sizeof(Conn));
+                    if (!nc) { perror("calloc"); exit(1); }
+                    nc -> fd = res;
+                    arm_recv(&r, nc);
+                }
+                if (!more)
+                    arm_accept(&r, listen_fd);
+                continue;
+            }
+
+            if (tag == TAG_RECV) {
+                if (res > 0) {
+                    unsigned bid = cqe -> flags >> IORING_CQE_BUFFER_SHIFT;
+                    if (!c -> failed && !take_input(c, r.bufs + (size_t)bid * BUF_SIZE, (size_t)res))
+                        fail_conn(c);
+                    ring_return_buffer(&r, bid);
+                } else if (res != -ENOBUFS) {
+                    c -> closing = 1;  //end of input or a failed recv - still send whatever was produced
+                }
+                if (!more) {
+                    c -> reading = 0;
+                    if (!c -> closing)
+                        arm_recv(&r, c);  //the multishot recv ran out of buffers - rearm it
+                }
+            } else {
+                c -> sending = 0;
+                if (res < 0)
+                    fail_conn(c);
+                else
+                    out_advance(c, (size_t)res);
+            }
+
+            if (!c -> failed && !c -> sending && !c -> queued && c -> out_head < c -> out_count) {
+                if (dirty_count == dirty_cap) {
+                    dirty_cap = dirty_cap ? dirty_cap * 2 : 64;
+                    Conn **tmp = realloc(dirty, dirty_cap * sizeof(Conn *));
+                    if (!tmp) { perror("realloc"); exit(1); }
+                    dirty = tmp;
+                }
+                dirty[dirty_count++] = c;
+                c -> queued = 1;
+            }
+            maybe_close(c);
+        }
+        store_release(r.cq_head, head);
+
+        //one sendmsg per connection covers every response this batch produced for it
+        for (size_t k = 0; k < dirty_count; k++) {
+            Conn *c = dirty[k];
+            c -> queued = 0;
+            if (!c -> failed && !c -> sending) {
+                if (!out_prepare(c))
+                    fail_conn(c);
+                else if (c -> out_head < c -> out_count)
+                    arm_send(&r, c);
+            }
+            maybe_close(c);
+        }
+        dirty_count = 0;
+    }
+    return NULL;
+}
+
+//checks the kernel has everything uring_worker needs - multishot recv arrived in 6.0, together with IORING_OP_SEND_ZC
+//returns 0 and says why if it does not
+static int uring_supported(void) {
+    Ring r;
+    if (!ring_init(&r, 8)) {
+        fprintf(stderr, "io_uring unavailable (%s)", strerror(errno));
+        return 0;
+    }
+
+    size_t probe_size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, probe_size);
+    if (!probe) { perror("calloc"); exit(1); }
+    int ok = uring_register(r.fd, IORING_REGISTER_PROBE, probe, 256) >= 0;
+    int needed[] = { IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SENDMSG, IORING_OP_SEND_ZC };
+    for (size_t k = 0; ok && k < sizeof(needed) / sizeof(needed[0]); k++)
+        ok = needed[k] <= probe -> last_op && (probe -> ops[needed[k]].flags & IO_URING_OP_SUPPORTED);
+    free(probe);
+    if (!ok)
+        fprintf(stderr, "io_uring lacks multishot accept/recv");
+    else if (!ring_add_buffers(&r)) {
+        fprintf(stderr, "io_uring lacks provided buffer rings");
+        ok = 0;
+    } else {
+        free(r.bufs);
+        munmap(r.br, BUF_COUNT * sizeof(struct io_uring_buf));
+    }
+    munmap(r.sqes, r.sq_entries * sizeof(struct io_uring_sqe));
+    munmap(r.rings, r.rings_size);
+    close(r.fd);
+    return ok;
+}
+
+int main(int argc, char **argv) {
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    const char *mode = "uring";
+    const char *snapshot = NULL;
+    const char *wal = NULL;
+    const char *rules = NULL;
+    unsigned window_us = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "p:t:m:s:w:g:l:")) != -1) {
+        switch (opt) {
+            case 'p': port = atoi(optarg); break;
+            case 't': threads = atol(optarg); break;
+            case 'm': mode = optarg; break;
+            case 's': snapshot = optarg; break;
+            case 'w': wal = optarg; break;
+            case 'g': window_us = (unsigned)atoi(optarg); break;
+            case 'l': rules = optarg; break;
+            default:
+                fprintf(stderr, "usage: %s [-p port] [-t threads] [-m uring|epoll] [-s snapshot] [-w wal] [-g group commit usec] [-l rules file]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (threads < 1)
+        threads = 1;
+    if (strcmp(mode, "uring") != 0 && strcmp(mode, "epoll") != 0) {
+        fprintf(stderr, "unknown mode %s - expected uring or epoll\n", mode);
+        return 1;
+    }
+    if (strcmp(mode, "uring") == 0 && !uring_supported()) {
+        fprintf(stderr, ", falling back to epoll\n");
+        mode = "epoll";
+    }
+    void *(*worker)(void *) = strcmp(mode, "uring") == 0 ? uring_worker : epoll_worker;
+
+    for (int b = 0; b < 256; b++)
+        byte_values[b] = (char)b;
+    signal(SIGPIPE, SIG_IGN);  //a client hanging up mid-write should fail the write, not kill the server
+
+    if (snapshot) {
+        if (loadSnapshot(snapshot))
+            fprintf(stderr, "restored from %s\n", snapshot);
+        else if (errno != ENOENT) {  //a missing file just means a first start
+            perror(snapshot);
+            return 1;
+        }
+    }
+    if (wal && !openWal(wal, window_us)) {  //replays whatever changed after the snapshot was saved
+        perror(wal);
+        return 1;
+    }
+    if (rules) {
+        size_t bad_line = 0;
+        if (!loadRulesFile(rules, &bad_line)) {
+            if (bad_line)
+                fprintf(stderr, "%s:%zu: not a valid rule, nothing was loaded\n", rules, bad_line);
+            else
+                perror(rules);
+            return 1;
+        }
+        fprintf(stderr, "loaded rules from %s\n", rules);
+    }
+
+    //the signals are blocked before the workers start so that they inherit the mask, and only main ever sees them
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR1);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGINT);
+    if (snapshot)
+        pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    pthread_t *tids = malloc((size_t)threads * sizeof(pthread_t));
+    if (!tids) { perror("malloc"); exit(1); }
+    for (long i = 0; i < threads; i++)
+        if (pthread_create(&tids[i], NULL, worker, NULL) != 0) { perror("pthread_create"); exit(1); }
+
+    fprintf(stderr, "listening on port %d with %ld %s worker threads\n", port, threads, mode);
+    while (snapshot) {
+        int sig;
+        if (sigwait(&signals, &sig) != 0)
+            continue;
+        if (saveSnapshot(snapshot))
+            fprintf(stderr, "saved %s\n", snapshot);
+        else
+            perror(snapshot);
+        if (sig != SIGUSR1)
+            exit(0);  //the workers never return, so the server stops here
+    }
+    for (long i = 0; i < threads; i++)
+        pthread_join(tids[i], NULL);
+    return 0;
+}
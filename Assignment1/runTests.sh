@@ -0,0 +1,12 @@
+#!/bin/sh
+# Builds and runs the engine's tests. Each one prints a summary line and exits non-zero on failure, which stops the script.
+# Usage: ./runTests.sh
+
+set -e
+cd "$(dirname "$0")"
+
+gcc -O2 -Wall -pthread parseTest.c -o parseTest
+./parseTest
+
+gcc -O2 -Wall -pthread crashTest.c -o crashTest
+./crashTest
@@ -4,8 +4,36 @@
 #include <stdint.h>
 #include <pthread.h>
 #include <ctype.h>
+#include <stdatomic.h>
+#include <sched.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <stddef.h>
+#include <stdarg.h>
+#include <arpa/inet.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 extern char *processRequest(char *request);
+extern const char *processRequestInto(const char *request, size_t len, char *buf, size_t cap);
+extern int setQueryHistoryMode(int mode);
+extern void checkBatch(const uint32_t *ips, const uint16_t *ports, size_t n, uint8_t *accepted, uint64_t *rule_seq);
+extern size_t binaryFrameLength(uint8_t opcode);
+extern uint8_t processBinary(const uint8_t *frame);
+extern struct Listing *openListing(const char *request, size_t len);
+extern size_t readListing(struct Listing *l, char *buf, size_t cap);
+extern void closeListing(struct Listing *l);
+extern int saveSnapshot(const char *path);
+extern int loadSnapshot(const char *path);
+extern int openWal(const char *path, unsigned window_us);
+extern char *processBatch(const char *requests, size_t len, size_t *out_len);
+extern int loadRules(const char *buf, size_t len, size_t *bad_line);
+extern int loadRulesFile(const char *path, size_t *bad_line);
 
 // Query struct records single IP + port pair 
 typedef struct {
@@ -13,402 +41,4117 @@ typedef struct {
     int port;
 } Query;
 
-// Rule struct stores valid IP and port ranges and fields for a dynamic array to track which connections have satisfied the rule
+// Rule struct stores valid IP and port ranges - it is what parse_rule produces, and what A adds and D looks for
 typedef struct {
     uint32_t ip_start, ip_end;
     int port_start, port_end;
+} Rule;
+
+// Ip6 is an IPv6 address as two 64-bit halves - hi holds the first 8 bytes, so comparing (hi, lo) in order compares addresses
+typedef struct {
+    uint64_t hi, lo;
+} Ip6;
+
+// Rule6 is what parse_rule6 produces for an IPv6 rule
+typedef struct {
+    Ip6 ip_start, ip_end;
+    int port_start, port_end;
+} Rule6;
+
+// Query6 records a single IPv6 address + port pair
+typedef struct {
+    Ip6 ip;
+    int port;
+} Query6;
+
+// PackedQuery is the same ip/port pair as Query squeezed into 6 bytes - Query is padded out to 8
+typedef struct __attribute__((packed)) {
+    uint32_t ip;
+    uint16_t port;
+} PackedQuery;
+
+// QuerySet holds each distinct ip/port pair a rule accepted once, with a count of how many times it was seen
+// pairs and hits are kept in first-seen order, and slots is an open-addressed hash table of positions in pairs (+1, so 0 means empty)
+typedef struct {
+    PackedQuery *pairs;
+    uint32_t *hits;
+    size_t count, cap;  //for pairs and hits
+    uint32_t *slots;
+    size_t mask;  //number of slots - 1 (the number of slots is a power of 2)
+} QuerySet;
+
+#define QUERY_HISTORY_FULL 0  //default: every accepted query is kept, in order
+#define QUERY_HISTORY_DISTINCT 1  //compact: only distinct pairs and their hit counts are kept
+
+// QueryHistory is the dynamic array that tracks which connections have satisfied a rule
+// it is kept apart from the ranges because only recording a match and L ever touch it
+// each rule's history is a block of its own that never moves, so the shards can point at it while the rules table grows and compacts
+typedef struct {
     Query *queries;  //pointer to what will be the first dynamically allocated array of query structs 
     size_t query_count;  
     size_t query_cap;
     //size_t is the unsigned integer type defined in <stddef.h>: it is platform sized (e.g., 64-bit on 64-bit system)
-} Rule;
+    QuerySet *distinct;  //used instead of queries in QUERY_HISTORY_DISTINCT mode - allocated on the first match
+} QueryHistory;
 
-static Rule *rules;  //pointer to the dynamic array of Rule structs
-static size_t rule_count, rule_cap;  
-static char **requests;  //pointer to a dynamically allocated array of char* pointers, each pointing to a request string
-static size_t req_count, req_cap;
-static pthread_mutex_t global_lock = PTHREAD_MUTEX_INITIALIZER; //thread-safety mechanism
+// History6 is the query history of an IPv6 rule: every query in order, or in QUERY_HISTORY_DISTINCT mode each distinct pair once with a hit count
+// distinct pairs are found through an open-addressed slot table, the same way QuerySet does it
+typedef struct {
+    Query6 *queries;
+    uint32_t *hits;  //QUERY_HISTORY_DISTINCT only
+    size_t count, cap;  //for queries and hits
+    uint32_t *slots;  //QUERY_HISTORY_DISTINCT only: positions in queries + 1, so 0 means empty
+    size_t mask;
+} History6;
 
-static int parse_ip(const char *s, uint32_t *out) {  //takes the input string to parse and a pointer to where the the result (a 32-bit integer) should be stored
+// IndexNode is one node of the rule index: a treap ordered by (ip_start, seq) where every node also remembers the largest ip_end and smallest seq found anywhere in its subtree
+// only rules whose ip range is not a CIDR block are kept here - the rest go in the prefix trie
+// the heap priority that keeps the treap balanced is a hash of seq (index_priority), so it is not stored and a node fits a 64-byte arena block
+typedef struct IndexNode {
+    uint32_t ip_start, ip_end;
+    uint32_t max_end;  //largest ip_end in this subtree - lets a lookup skip subtrees that end before the ip
+    uint16_t port_start, port_end;
+    uint64_t seq;
+    uint64_t min_seq;  //smallest seq in this subtree - lets a lookup skip subtrees that cannot beat the best match found so far
+    QueryHistory *history;  //where a match on this rule is recorded
+    struct IndexNode *left, *right;
+} IndexNode;
 
-    int a, b, c, d;
-    int consumed = 0;  //tracks number of characters read by sscanf
+// PrefixEntry is one CIDR-aligned rule as seen from a slot of the prefix trie: its port range, seq and query history
+typedef struct {
+    uint64_t seq;
+    QueryHistory *history;
+    int32_t port_start, port_end;
+} PrefixEntry;
 
-    if (sscanf(s, "%d.%d.%d.%d%n", &a, &b, &c, &d, &consumed) != 4)  
-        return 0;  //triggered if anything other than 4 matches are made
+// PrefixList holds the rules covering one slot of a prefix trie node, in seq order, so the first one whose ports match is the first match
+typedef struct {
+    PrefixEntry *entries;
+    uint32_t count, cap;
+} PrefixList;
 
-    if (s[consumed] != '\0')  //checks for junk (anything other than \0) at the end of s
-            return 0;
+// PrefixNode is one node of the prefix trie: a multibit trie over the ip, one byte per level, so four levels at most
+// a rule for a /len block lives in the node at level (len - 1) / 8, in every slot its block covers there (a /32 in one slot, a /25 in 128)
+// slots are compressed as in Poptrie: a bitmap says which of the 256 slots have a child or a list, and only those are stored, packed in slot order
+typedef struct PrefixNode {
+    uint64_t child_bits[4], list_bits[4];
+    struct PrefixNode **children;
+    PrefixList *lists;
+} PrefixNode;
 
-    if (a < 0 || a > 255 || b < 0 || b > 255 ||
-        c < 0 || c > 255 || d < 0 || d > 255)  //checks each part of ip address is within valid range 
-        return 0;
+// RuleTable stores every rule in insertion order as separate arrays (structure of arrays): position i in each array describes the same rule
+// the hot columns (ranges and seq) are packed together so scans only pull range data through the cache, and can compare several rules at once with vector instructions
+// a deleted rule is left in place as a tombstone (a range that can never match) and the tombstones are squeezed out once they make up half the table
+typedef struct {
+    uint32_t *ip_start, *ip_end;
+    int32_t *port_start, *port_end;
+    uint64_t *seq;  //insertion sequence number - rules added earlier have smaller seq, so the lowest matching seq is the first match
+    QueryHistory **history;  //cold: the queries each rule has accepted
+    size_t count, cap;
+    size_t dead;  //how many of the count positions are tombstones
+} RuleTable;
 
-    *out = ((uint32_t)a << 24 | (uint32_t)b << 16 |
-            (uint32_t)c << 8 | (uint32_t)d);  //casts each section of the ip address to an unsigned integer and shifts chunk left to the correct position in the 32-bit integer
-            //the 32-bit integer is written through the *out pointer into the caller's variable
+// RuleTable6 holds the IPv6 rules, kept apart so the IPv4 columns, shards and lookups stay exactly as they were
+// it is in insertion order and shares next_seq with the rules table, so L interleaves the two by seq
+// it is only ever scanned, so there are no tombstones - D closes the gap straight away
+typedef struct {
+    Ip6 *ip_start, *ip_end;
+    int32_t *port_start, *port_end;
+    uint64_t *seq;
+    History6 **history;
+    size_t count, cap;
+} RuleTable6;
 
-    return 1;  //represents success
-}
+// RuleHash maps a rule's (ip_start, ip_end, port_start, port_end) to its position in the rules table, so D can find a rule without scanning
+// open addressing with linear probing - identical rules each get their own slot, and D takes the one added first
+typedef struct {
+    size_t *slots;  //table positions, HASH_EMPTY where unused
+    size_t mask;  //number of slots - 1 (the number of slots is a power of 2)
+    size_t used;
+} RuleHash;
 
-static int parse_port(const char *s, int *out) {
-    if (!isdigit((unsigned char) s[0])) return 0;  //rejects inputs with leading signs of whitespace which sscanf with %d would accept
+// LogChunk is one fixed-size block of the request log - chunks are linked in the order they were filled
+// each entry in data is a 4-byte header (length + 1, or 0 while the entry is still being written) followed by the request bytes, padded to a multiple of 4
+typedef struct LogChunk {
+    _Atomic(struct LogChunk *) next;
+    size_t size;  //number of bytes in data
+    atomic_size_t used;  //bytes reserved so far - appenders claim space with a fetch-add, so this can run past size when the chunk fills up
+    unsigned char data[];
+} LogChunk;
 
-    int port;
-    int consumed = 0;
+// LogPos is where an entry was written: the chunk it lives in and its offset inside that chunk
+typedef struct {
+    LogChunk *chunk;
+    size_t offset;
+} LogPos;
 
-    if (sscanf(s, "%d%n", &port, &consumed) != 1)
-        return 0;  //triggered if anything other than 1 match is made
+// Listing is a cursor over the output of one L or R - readListing hands the output out a piece at a time and remembers where it stopped
+// no lock is held between pieces, so L resumes by seq (which survives deletes and compaction) and R by log position (which only F can invalidate)
+typedef struct Listing {
+    char kind;  //'L', 'R' or 'S'
+    int done;
+    uint64_t busy;  //ticks spent producing the output so far, for the S statistics
+    char line[128];  //the line being handed out - every L line fits, IPv6 ranges included
+    size_t line_len, line_off;  //line[line_off .. line_len) has not been handed out yet
 
+    //L
+    uint64_t seq;  //seq of the rule being listed, or of the first rule not looked at yet
+    uint64_t end_seq;  //rules added after the L are left out
+    int header_done;  //the "Rule: ..." line of rule seq has been handed out
+    size_t query;  //queries of rule seq handed out so far
 
-    if (s[consumed] != '\0')  //checks for junk (anything other than \0) at the end of s
-        return 0;
+    //R
+    uint64_t generation;  //log_generation when the R ran - if an F has cleared the log since, the listing stops
+    LogPos pos;  //entry being handed out
+    size_t part;  //bytes of that entry (counting its '\n') already handed out
+    LogPos upto;  //the R itself - the last entry listed
 
-    if (port < 0 || port > 65535)  //checks that port is within valid integer range 
-        return 0;
+    //S
+    char *text;  //the whole report, made by the first readListing
+    size_t text_len, text_off;
+} Listing;
 
-    *out = port;  //port is written through the *out pointer into the caller's variable
+// WalRecord is the fixed part of one write-ahead log record - it is followed in the file by text_len bytes of request text
+// records are only written for A, D and F requests that changed the rules, in the order they changed them
+// an IPv6 A or D is written as 'a' or 'd' with the ip fields left at 0 - its range does not fit them, so a replay reads it back from the request text
+// a loadRules is written as one 'B' record holding its whole buffer, so a crash can never leave half of it replayed
+typedef struct {
+    uint32_t check;  //FNV-1a of everything after this field, text included - a record torn by a crash fails it
+    uint32_t text_len;  //the request that made the change, as text (binary ones in their text form), so a replay can put it back in the request log
+    uint64_t lsn;  //1 for the first record ever written, counting up from there - snapshots remember the last one they hold
+    uint32_t op;  //'A', 'D', 'F', 'a' or 'd' for IPv6, or 'B' for a bulk load
+    uint32_t ip_start, ip_end;
+    uint16_t port_start, port_end;
+} WalRecord;
 
-    return 1;  //represents success
+// WalBuffer holds records that have been appended but not yet written to the file
+typedef struct {
+    char *data;
+    size_t len, cap;
+} WalBuffer;
+
+static RuleTable rules;  //every rule, in the order they were added
+static RuleTable6 rules6;  //every IPv6 rule, in the order they were added - guarded by rules_lock alone, which IPv6 checks take for reading
+static LogChunk *log_head;  //first chunk of the request log
+static _Atomic(LogChunk *) log_tail;  //chunk new requests are currently appended to
+static pthread_once_t log_once = PTHREAD_ONCE_INIT;
+static RuleHash rule_hash;  //exact-match index over every live rule in the rules table
+static uint64_t next_seq = 1;  //seq handed to the next rule added (0 is never used)
+static uint64_t log_generation;  //bumped by every F, which frees the log under any R still being listed
+static char *snapshot_map;  //the snapshot loaded by loadSnapshot, mapped copy-on-write - rule columns, query histories and the first log chunk can point into it
+static size_t snapshot_size;
+static int history_mode = QUERY_HISTORY_FULL;  //how accepted queries are recorded - can only change while there are no rules
+
+//write-ahead log, only kept once openWal has been called
+static int wal_fd = -1;
+static unsigned wal_window_us;  //how long a commit waits for other mutators to join its fdatasync
+static uint64_t wal_lsn;  //lsn of the last record appended - only changed with rules_lock held for writing
+static pthread_mutex_t wal_mutex = PTHREAD_MUTEX_INITIALIZER;  //guards everything below
+static pthread_cond_t wal_synced = PTHREAD_COND_INITIALIZER;  //broadcast whenever wal_durable moves on
+static WalBuffer wal_pending, wal_spare;  //records waiting for the next write, and the buffer the last write used
+static uint64_t wal_buffered;  //lsn of the last record in wal_pending
+static uint64_t wal_durable;  //every record up to this lsn is on disk
+static int wal_syncing;  //a commit is writing and syncing the file - everyone else waits for it
+
+//A, D and F take rules_lock for writing, L, R, S and anything malformed take it for reading - a well-formed C does not take it at all
+static pthread_rwlock_t rules_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+// the lookup side of the engine is split into shards by the top SHARD_BITS bits of the ip, each with its own lock, treap and trie
+// a C only locks and searches the shard its ip falls in - a rule whose range spans several shards is stored in each of them, cut down to that shard's ips and carrying its global seq
+// the rules table itself (insertion order, seq, history) stays whole, so L, R, D and snapshots see one global order without merging anything
+// A and D take rules_lock and then the locks of the shards their rule falls in, F every shard - always in shard order, so writers can never deadlock
+#define SHARD_BITS 6
+#define SHARD_COUNT (1u << SHARD_BITS)
+
+// Shard is one slice of the ip space and the lookup structures for the rules (or parts of rules) that fall in it
+typedef struct {
+    pthread_rwlock_t lock;  //C takes it for reading, A, D and F for writing
+    IndexNode *index;  //interval index over the rules in this shard that are not CIDR blocks
+    PrefixNode *prefix;  //prefix trie over the ones that are
+    uint64_t generation;  //bumped by every change to the rules in this shard, so decision cache entries made before it stop matching - starts at 1, 0 marks an empty entry
+} __attribute__((aligned(64))) Shard;  //a cache line of its own, so checks in different shards never touch the same line
+
+// RequestPlan is what execute works out about a request before locking anything: which locks it needs, and for C its parsed arguments
+typedef struct {
+    int exclusive;  //A, D and F change the rules
+    unsigned first, last;  //shards to lock for writing - none unless first <= last
+    Shard *shard;  //the one shard a well-formed C locks for reading
+    int check_ok;  //args holds a well-formed C's ip and port
+    int check6;  //args6 holds a well-formed IPv6 C's ip and port - those read rules6 under rules_lock
+    Rule args;
+    Rule6 args6;
+} RequestPlan;
+
+static Shard shards[SHARD_COUNT] = { [0 ... SHARD_COUNT - 1] = { .lock = PTHREAD_RWLOCK_INITIALIZER, .generation = 1 } };
+
+static unsigned shard_of(uint32_t ip) {
+    return ip >> (32 - SHARD_BITS);
+}
+
+//locks what a change to the rules in shards first to last needs: rules_lock, then those shards in order, all for writing
+//first > last locks no shard - for an A or D that turns out to be malformed
+static void lock_for_write(unsigned first, unsigned last) {
+    pthread_rwlock_wrlock(&rules_lock);
+    for (unsigned s = first; s <= last; s++)
+        pthread_rwlock_wrlock(&shards[s].lock);
 }
 
-static int parse_rule(const char *s, Rule *out) {  //takes const char *s - the input string to parse and Rule *out 
+static void unlock_for_write(unsigned first, unsigned last) {
+    for (unsigned s = first; s <= last; s++)
+        pthread_rwlock_unlock(&shards[s].lock);
+    pthread_rwlock_unlock(&rules_lock);
+}
 
-    char ip_part[64], port_part[32];  //fixed size arrays to store the ip and port after split
+//readers that match a rule append to its queries array under one of these striped locks (picked by the rule's seq) instead of an exclusive lock
+#define QUERY_LOCK_STRIPES 64
+static pthread_mutex_t query_locks[QUERY_LOCK_STRIPES] = { [0 ... QUERY_LOCK_STRIPES - 1] = PTHREAD_MUTEX_INITIALIZER };
 
-    //searches for space that would split ip and port in a valid input 
-    const char *sp = strchr(s, ' ');  //scans through string and returns pointer to first occurence of a ' ' or NULL if not found
-    if (!sp) return 0;  
-    if (sp != strrchr(s, ' ')) return 0;  //checks that pointer to first occurence of ' ' is the same as last occurence of ' ' (i.e., there is only one space in the input)
-    if (strpbrk(s, "\t\r\n")) return 0;  //rejects any stings containing tabs, carriage returns or newlines
+static pthread_mutex_t *query_lock_for(uint64_t seq) {
+    return &query_locks[seq % QUERY_LOCK_STRIPES];
+}
 
-    if (sscanf(s, "%63s %31s", ip_part, port_part) != 2)
-    //%63s reads up to 63 characters into ip_part, %31s reads up to 31 characters into port_part.
-    //note that ip_part is the raw input string - it is packed into a 32-bit integer only when parse_ip is called on it  
-        return 0;  //triggered if anything other than 2 matches are made (i.e., a valid ip address and a vallid port)
+//commands as the S statistics count them
+enum { OP_C, OP_A, OP_D, OP_F, OP_L, OP_R, OP_S, OP_ILLEGAL, OP_COUNT };
 
-    //searches for '-' that would indicate a valid ip range rather than a single valid ip address
-    char *ip_dash = strchr(ip_part, '-'); //scans through string and returns pointer to first occurence of a '-' or NULL if not found
-    if (ip_dash) {
-        *ip_dash = '\0';  //write '\0' in place of dash - separates range into two separate strings
-        if (!parse_ip(ip_part, &out -> ip_start)) return 0;  //parse first ip address
-        if (!parse_ip(ip_dash + 1, &out -> ip_end)) return 0;  //parse second ip address
-        if (out -> ip_start >= out -> ip_end) return 0;  //checks that second address greater than the first - indicating valid range  
-    } else {
-        //handles single valid ip address rather than valid ip range 
-        if (!parse_ip(ip_part, &out -> ip_start)) return 0;
-        out -> ip_end = out -> ip_start; //sets ip_start and ip_end to the same value (rule allows single valid ip)
-    }
+#ifndef NO_STATS
+// instrumentation reported by S - build with -DNO_STATS to compile all of it out
+// every thread records into its own Stats, so recording never takes a lock or shares a cache line with another thread - S adds them all up when it runs
+#define STAT_BUCKETS (16 + (40 - 4 + 1) * 8)  //exact below 16, then 8 buckets per power of 2 up to 2^40 (minutes, in clock ticks) - larger values go in the last bucket
 
-    //searches for '-' that would indicate a valid port range rather than a single valid port number
-    //note that this function follows the same logical flow as ip_dash
-    char *port_dash = strchr(port_part, '-');
-    if (port_dash) {
-        *port_dash = '\0';
-        if (!parse_port(port_part, &out -> port_start)) return 0;
-        if (!parse_port(port_dash + 1, &out -> port_end)) return 0;
-        if (out -> port_start >= out -> port_end) return 0;
-    } else {
-        if (!parse_port(port_part, &out -> port_start)) return 0;
-        out -> port_end = out -> port_start;
+// Histogram counts values in log-linear buckets, the way HdrHistogram does: every value is within 12.5% of the top of its bucket
+// only the owning thread writes one, with relaxed loads and stores rather than atomic adds, so S can read it at any time
+typedef struct {
+    _Atomic uint64_t count, sum, max;
+    _Atomic uint64_t buckets[STAT_BUCKETS];
+} Histogram;
+
+// Stats is everything one thread has recorded - it outlives the thread and is handed to the next thread that starts, so totals never go backwards
+typedef struct Stats {
+    Histogram latency[OP_COUNT];  //time per request, by command - an L, R or S counts the time spent producing its output, not the time it was open
+    Histogram lock_wait[2], lock_hold[2];  //time spent waiting for and holding rules_lock or a shard lock - [0] for reading, [1] for writing (rules_lock and shards together)
+    Histogram scan;  //index nodes and trie entries each C looked at - checks answered by the decision cache look at none and are not counted
+    _Atomic uint64_t allocs;  //blocks the engine took from malloc or grew - the arena only counts the regions and large blocks it asks for
+    _Atomic uint64_t cache_hits, cache_misses;  //C checks answered from the decision cache, and those that had to search their shard
+    atomic_int in_use;  //owned by a running thread
+    struct Stats *next;
+} Stats;
+
+static _Atomic(Stats *) stats_threads;  //every Stats ever made - the list only grows
+static __thread Stats *my_stats;
+static __thread uint64_t scan_steps;  //counted by the lookups of the C in progress
+static pthread_key_t stats_key;
+static pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+static uint64_t stats_start_ns, stats_start_ticks;  //clock and stat_now readings taken together, which S compares with a later pair to turn ticks into ns
+
+static void stats_release(void *s) {
+    atomic_store(&((Stats *)s) -> in_use, 0);
+}
+
+static uint64_t clock_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+//times are recorded in ticks of the cheapest clock there is - the cpu's timestamp counter on x86 (constant-rate on anything recent), ns elsewhere
+//S converts to ns, so recording a time never pays for a clock_gettime
+static uint64_t stat_now(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return clock_ns();
+#endif
+}
+
+static void stats_init(void) {
+    pthread_key_create(&stats_key, stats_release);  //hands a thread's Stats back when it exits
+    stats_start_ns = clock_ns();
+    stats_start_ticks = stat_now();
+}
+
+//returns the calling thread's Stats, taking over one left by a thread that has exited, or making a new one
+static Stats *stats_mine(void) {
+    if (my_stats)
+        return my_stats;
+    pthread_once(&stats_once, stats_init);
+    Stats *s;
+    for (s = atomic_load(&stats_threads); s; s = s -> next) {
+        int expected = 0;
+        if (atomic_compare_exchange_strong(&s -> in_use, &expected, 1))
+            break;
     }
+    if (!s) {
+        s = calloc(1, sizeof(Stats));
+        if (!s) { perror("calloc"); exit(1); }
+        s -> in_use = 1;
+        s -> next = atomic_load(&stats_threads);
+        while (!atomic_compare_exchange_weak(&stats_threads, &s -> next, s))
+            ;
+    }
+    pthread_setspecific(stats_key, s);
+    my_stats = s;
+    return s;
+}
 
-    return 1;  //represents success
+static void stat_add(_Atomic uint64_t *counter, uint64_t v) {
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + v, memory_order_relaxed);
 }
 
-static int ip_in_range(uint32_t ip, const Rule *r) {
-    return ip >= r -> ip_start && ip <= r -> ip_end;  //returns 1 if ip falls within valid range
+static unsigned stat_bucket(uint64_t v) {
+    if (v < 16)
+        return (unsigned)v;
+    unsigned e = 63 - (unsigned)__builtin_clzll(v);  //v is in [2^e, 2^(e + 1))
+    if (e > 40)
+        return STAT_BUCKETS - 1;
+    return 16 + (e - 4) * 8 + (unsigned)(v >> (e - 3) & 7);
 }
 
-static int port_in_range(int port, const Rule *r) {
-    return port >= r -> port_start && port <= r -> port_end;  //returns 1 if port falls within valid range 
+//the largest value that lands in bucket b
+static uint64_t stat_bucket_top(unsigned b) {
+    if (b < 16)
+        return b;
+    unsigned e = (b - 16) / 8 + 4, sub = (b - 16) % 8;
+    return ((8ull + sub + 1) << (e - 3)) - 1;
 }
 
-static char *make_response(const char *s) {  //called inside handler functions whenever they have to return a response string 
-    char *r = strdup(s);  //allocates enough heap memory to fit the input string, copies it in, and returns a pointer to it - that pointer gets stored in r and returned
-    if (!r) { perror("strdup"); exit(1); }  //error handling for strdup - kills program immediately if strdup can't allocate memory for a response string 
-    return r;
+static void histogram_record(Histogram *h, uint64_t v) {
+    stat_add(&h -> count, 1);
+    stat_add(&h -> sum, v);
+    if (v > atomic_load_explicit(&h -> max, memory_order_relaxed))
+        atomic_store_explicit(&h -> max, v, memory_order_relaxed);
+    stat_add(&h -> buckets[stat_bucket(v)], 1);
 }
 
-static void ip_to_str(uint32_t ip, char *buf) {
-    sprintf(buf, "%u.%u.%u.%u", 
-            (ip >> 24) & 0xFF,
-            (ip >> 16) & 0xFF,
-            (ip >> 8)  & 0xFF,
-            ip         & 0xFF); //sprintf takes a pointer to where to write the output, the format string telling it how to write the output and 4 integers to write
-            //shifting the 32-bit string then & 0xFF has the effect of isolating each 8 bit chunk
+static void stat_request(int op, uint64_t ticks) {
+    histogram_record(&stats_mine() -> latency[op], ticks);
 }
 
-//keeps a record of every request that comes into the server in the order they arrived 
-static void log_request(const char *request) {
-    //if the capacity of the requests array is met, increase capacity 
-    if (req_count == req_cap) {
-        size_t new_cap;
-        if(req_cap == 0) {
-            new_cap = 8;
-        } else {
-            new_cap = req_cap * 2;
+static void stat_lock(int exclusive, uint64_t wait_ticks, uint64_t hold_ticks) {
+    Stats *s = stats_mine();
+    histogram_record(&s -> lock_wait[exclusive], wait_ticks);
+    histogram_record(&s -> lock_hold[exclusive], hold_ticks);
+}
+
+static void stat_scan_begin(void) {
+    scan_steps = 0;
+}
+
+static void stat_scan_end(void) {
+    histogram_record(&stats_mine() -> scan, scan_steps);
+}
+
+//records the length of a scan that was not counted step by step
+static void stat_scan(uint64_t steps) {
+    histogram_record(&stats_mine() -> scan, steps);
+}
+
+#define STAT_STEP() (scan_steps++)
+
+static void stat_alloc(void) {
+    stat_add(&stats_mine() -> allocs, 1);
+}
+
+static void stat_cache(int hit) {
+    Stats *s = stats_mine();
+    stat_add(hit ? &s -> cache_hits : &s -> cache_misses, 1);
+}
+#else
+//with NO_STATS every hook is empty, so the compiler drops the calls and the clock reads entirely
+static uint64_t stat_now(void) { return 0; }
+static void stat_request(int op, uint64_t ticks) { (void)op; (void)ticks; }
+static void stat_lock(int exclusive, uint64_t wait_ticks, uint64_t hold_ticks) { (void)exclusive; (void)wait_ticks; (void)hold_ticks; }
+static void stat_cache(int hit) { (void)hit; }
+static void stat_scan_begin(void) {}
+static void stat_scan_end(void) {}
+static void stat_scan(uint64_t steps) { (void)steps; }
+#define STAT_STEP() ((void)0)
+static void stat_alloc(void) {}
+#endif
+
+// the engine arena: rule columns, query histories, index and trie nodes and log chunks are all carved out of a few large regions rather than malloc'd one at a time
+// every block has an 8-byte header holding its size class, and a freed block goes on the free list for its class to be handed out again
+// F drops everything at once with arena_reset, which rewinds to the first region and keeps the regions for reuse - it never looks at a rule
+#define ARENA_REGION_SIZE (4u << 20)  //bytes per region
+#define ARENA_LARGE (ARENA_REGION_SIZE / 4)  //blocks bigger than this (header included) get a malloc of their own
+#define ARENA_CLASSES 33  //16, 24, 32, 48, 64, 96 ... up to ARENA_LARGE bytes - two classes per power of 2
+#define ARENA_CLASS_LARGE UINT64_MAX  //header of a block with a malloc of its own
+
+// ArenaRegion is one large block the arena carves allocations out of, from the front
+typedef struct ArenaRegion {
+    struct ArenaRegion *next;
+    size_t used;
+    unsigned char data[];  //ARENA_REGION_SIZE bytes
+} ArenaRegion;
+
+// ArenaLarge sits in front of a block too big for a region - they are linked so F can free them without finding them through the rules
+typedef struct ArenaLarge {
+    struct ArenaLarge *prev, *next;
+    size_t size;  //bytes the caller asked for
+} ArenaLarge;
+
+static ArenaRegion *arena_regions;  //every region ever allocated - F keeps them
+static ArenaRegion *arena_current;  //region blocks are carved from now - the ones after it are empty
+static uint64_t *arena_free_lists[ARENA_CLASSES];  //headers of freed blocks, linked through their first 8 bytes
+static ArenaLarge *arena_large;
+static pthread_mutex_t arena_lock = PTHREAD_MUTEX_INITIALIZER;  //C requests in different shards allocate at the same time, so the arena needs its own lock - nothing is ever done while holding it
+
+static size_t arena_class_size(unsigned c) {
+    return (size_t)(2 + (c & 1)) << (3 + c / 2);
+}
+
+//the smallest class whose blocks hold total bytes
+static unsigned arena_class(size_t total) {
+    if (total <= 16)
+        return 0;
+    int b = 63 - __builtin_clzll((unsigned long long)(total - 1));  //2^b < total <= 2^(b + 1)
+    if (total <= (size_t)3 << (b - 1))
+        return (unsigned)(2 * (b - 4) + 1);
+    return (unsigned)(2 * (b - 3));
+}
+
+//takes size bytes from the end of the used part of the current region, moving on to the next region (or a new one) when it is full
+static uint64_t *arena_carve(size_t size) {
+    while (!arena_current || arena_current -> used + size > ARENA_REGION_SIZE) {
+        if (arena_current && arena_current -> next) {
+            arena_current = arena_current -> next;
+            arena_current -> used = 0;
+            continue;
         }
-        char **tmp = realloc (requests, new_cap * sizeof(char *));  //resize requests array to hold new_cap pointers, and store the result in tmp
-        if (!tmp) { perror("realloc"); exit(1); }  //error handling for realloc - kills program immediately if tmp is NULL
-        requests = tmp;  
-        req_cap = new_cap;  //update capacity of requests array
+        ArenaRegion *r = malloc(sizeof(ArenaRegion) + ARENA_REGION_SIZE);
+        if (!r) { perror("malloc"); exit(1); }
+        stat_alloc();
+        r -> next = NULL;
+        r -> used = 0;
+        if (arena_current)
+            arena_current -> next = r;
+        else
+            arena_regions = r;
+        arena_current = r;
     }
-    requests[req_count] = strdup(request);  //allocates memory on the heap, stores a copy of the new request there and returns a pointer to that request which is stored in the next empty slot in the requests array
-    if (!requests[req_count]) { perror("strdup"); exit(1); }  //error handling for strdup - kills program immediately if empty slot is NULL
-    req_count++;
+    uint64_t *b = (uint64_t *)(arena_current -> data + arena_current -> used);
+    arena_current -> used += size;
+    return b;
 }
 
-//concatenate every request thats ever been logged
-static char *handle_R(void) {
-    if (req_count == 0)
-        return make_response("");
+static void *arena_alloc(size_t size) {
+    size_t total = size + sizeof(uint64_t);
+    if (total > ARENA_LARGE) {
+        ArenaLarge *l = malloc(sizeof(ArenaLarge) + total);
+        if (!l) { perror("malloc"); exit(1); }
+        stat_alloc();
+        l -> size = size;
+        l -> prev = NULL;
+        pthread_mutex_lock(&arena_lock);
+        l -> next = arena_large;
+        if (arena_large)
+            arena_large -> prev = l;
+        arena_large = l;
+        pthread_mutex_unlock(&arena_lock);
+        uint64_t *b = (uint64_t *)(l + 1);
+        *b = ARENA_CLASS_LARGE;
+        return b + 1;
+    }
 
-    size_t total = 0; //total created to store number of bytes required to store all request strings 
-    for (size_t i = 0; i < req_count; i++)
-        total += strlen(requests[i]) + 1;  //+1 to each string for '\n'
+    unsigned c = arena_class(total);
+    pthread_mutex_lock(&arena_lock);
+    uint64_t *b = arena_free_lists[c];
+    if (b)
+        arena_free_lists[c] = *(uint64_t **)(b + 1);
+    else
+        b = arena_carve(arena_class_size(c));
+    pthread_mutex_unlock(&arena_lock);
+    *b = c;
+    return b + 1;
+}
 
-    char *response = malloc(total + 1); //allocated enough memory for total + 1 ('\0' at the end) and returns a pointer to it called response
-    if (!response) { perror("malloc"); exit(1); }
+static void *arena_zalloc(size_t size) {
+    void *p = arena_alloc(size);
+    memset(p, 0, size);
+    return p;
+}
 
-    char *p = response;  //creates new pointer to same place in memory as response called p
-    for (size_t i = 0; i < req_count; i++) {
-        size_t len = strlen(requests[i]);
-        memcpy(p, requests[i], len); //copies len bytes from requests[i] to p
-        p += len; //moves p beyond newly written string
-        *p++ = '\n';  //writes '\n' then moves past it to start writing the next string 
+//hands out count blocks of size bytes into blocks[], taking arena_lock once for the lot - each is an ordinary block that arena_free takes back on its own
+static void arena_alloc_many(size_t size, size_t count, void **blocks) {
+    size_t total = size + sizeof(uint64_t);
+    if (total > ARENA_LARGE) {
+        for (size_t k = 0; k < count; k++)
+            blocks[k] = arena_alloc(size);
+        return;
     }
-       *p = '\0'; //properly ends the string of all requests with '\0'
 
-    return response; //return string of all requests
+    unsigned c = arena_class(total);
+    pthread_mutex_lock(&arena_lock);
+    for (size_t k = 0; k < count; k++) {
+        uint64_t *b = arena_free_lists[c];
+        if (b)
+            arena_free_lists[c] = *(uint64_t **)(b + 1);
+        else
+            b = arena_carve(arena_class_size(c));
+        *b = c;
+        blocks[k] = b + 1;
+    }
+    pthread_mutex_unlock(&arena_lock);
 }
 
-//create rule
-static char *handle_A(const char *request) {
-    const char *rule_str = request + 2;  //rule_str is a pointer to the first element of the ip address part of the input string 
+//bytes the block at p can hold
+static size_t arena_usable(const void *p) {
+    const uint64_t *b = (const uint64_t *)p - 1;
+    if (*b == ARENA_CLASS_LARGE)
+        return ((const ArenaLarge *)b - 1) -> size;
+    return arena_class_size((unsigned)*b) - sizeof(uint64_t);
+}
 
-    Rule r = {0};  //creates new Rule struct and initializes all fields to 0 (or pointers to NULL)
-    if (!parse_rule(rule_str, &r))  //calls parse rule on the rule_str string (starting at the element it points to - the start of the ip address)
-        return make_response("Invalid rule");
+//whether p points into the loaded snapshot rather than the arena - such blocks are copied before they grow and are never freed
+static int is_mapped(const void *p) {
+    return snapshot_map && (const char *)p >= snapshot_map && (const char *)p < snapshot_map + snapshot_size;
+}
 
-    //allocate a new larger block of memory to hold more Rule structs, and store the result in tmp
-    if (rule_count == rule_cap) {
-        size_t new_cap;
-        if(rule_cap == 0) {
-            new_cap = 8;
-        } else {
-            new_cap = rule_cap * 2;
+static void arena_unlink(ArenaLarge *l) {
+    if (l -> prev)
+        l -> prev -> next = l -> next;
+    else
+        arena_large = l -> next;
+    if (l -> next)
+        l -> next -> prev = l -> prev;
+}
+
+static void arena_free(void *p) {
+    if (!p || is_mapped(p))
+        return;
+    uint64_t *b = (uint64_t *)p - 1;
+    pthread_mutex_lock(&arena_lock);
+    if (*b == ARENA_CLASS_LARGE) {
+        ArenaLarge *l = (ArenaLarge *)b - 1;
+        arena_unlink(l);
+        pthread_mutex_unlock(&arena_lock);
+        free(l);
+        return;
+    }
+    *(uint64_t **)(b + 1) = arena_free_lists[*b];
+    arena_free_lists[*b] = b;
+    pthread_mutex_unlock(&arena_lock);
+}
+
+//grows the block at p to new_size bytes - it stays put while its class has room, and a block that lives in the snapshot is copied (old_size bytes of it) out instead
+static void *arena_realloc(void *p, size_t old_size, size_t new_size) {
+    if (p && !is_mapped(p)) {
+        if (new_size <= arena_usable(p))
+            return p;
+        uint64_t *b = (uint64_t *)p - 1;
+        if (*b == ARENA_CLASS_LARGE) {  //large blocks go straight to realloc, which can move the pages rather than copy them
+            pthread_mutex_lock(&arena_lock);
+            ArenaLarge *l = (ArenaLarge *)b - 1;
+            arena_unlink(l);
+            l = realloc(l, sizeof(ArenaLarge) + sizeof(uint64_t) + new_size);
+            if (!l) { perror("realloc"); exit(1); }
+            stat_alloc();
+            l -> size = new_size;
+            l -> prev = NULL;
+            l -> next = arena_large;
+            if (arena_large)
+                arena_large -> prev = l;
+            arena_large = l;
+            pthread_mutex_unlock(&arena_lock);
+            return (uint64_t *)(l + 1) + 1;
         }
-        Rule *tmp = realloc(rules, new_cap * sizeof(Rule));  
-        if (!tmp) { perror("realloc"); exit(1); }  //error handling for realloc - kills program immediately if tmp is NULL
-        rules = tmp;  
-        rule_cap = new_cap;
+        old_size = arena_usable(p);
     }
+    void *fresh = arena_alloc(new_size);
+    if (p)
+        memcpy(fresh, p, old_size < new_size ? old_size : new_size);
+    arena_free(p);
+    return fresh;
+}
 
-    rules[rule_count++] = r;  //adds new Rule struct r to the first empty slot in the allocated memory 
-    return make_response("Rule added");
+//forgets every block at once: the free lists are emptied and carving starts again at the front of the first region
+//only large blocks are handed back to malloc, and there are few of them - each is at least ARENA_LARGE bytes
+static void arena_reset(void) {
+    pthread_mutex_lock(&arena_lock);
+    memset(arena_free_lists, 0, sizeof(arena_free_lists));
+    arena_current = arena_regions;
+    if (arena_current)
+        arena_current -> used = 0;
+    ArenaLarge *l = arena_large;
+    while (l) {
+        ArenaLarge *next = l -> next;
+        free(l);
+        l = next;
+    }
+    arena_large = NULL;
+    pthread_mutex_unlock(&arena_lock);
 }
 
-//C is used to check whether an ip address/port pair are both valid/well formed AND allowed according to the rules
-static char *handle_C(const char *request) {
-    const char *rest = request + 2;
+// the A, C and D arguments are "<ip>[-<ip>] <port>[-<port>]" and are read in a single pass over the string by scan_args
+// scan_args accepts and rejects exactly the same strings as the earlier strchr/strpbrk + sscanf("%63s %31s") + sscanf("%d.%d.%d.%d%n") parsing did, quirks included:
+//  - the ip token is cut off after 63 characters and the port token after 31 (the rest of an over-long ip token becomes the port token)
+//  - anything after the port token is ignored as long as it holds no extra ' ', '\t', '\r' or '\n'
+//  - each number is read like glibc's %d: an optional sign (never on a port), then digits converted as a long and truncated to int
+
+// FieldScan is the state for one token - either the ip part or the port part
+typedef struct {
+    int is_ip;  //ip token (four dotted numbers) or port token (one number)
+    int allow_range;  //whether a '-' may split the token into a start and an end
+    int half;  //0 while reading the start, 1 once the '-' has been seen
+    int part;  //which number of the current address is being read (0 to 3 for an ip)
+    int sign;  //+1 or -1 once a sign has been read, 0 if none
+    int digits;  //digits read for the current number
+    uint64_t mag;  //value of those digits - stops growing once it is past what a long can hold
+    uint32_t value[2];  //start and end values built so far
+    int ok;  //cleared as soon as the token can no longer be valid
+    int started;  //whether any character has been fed in yet
+} FieldScan;
 
-    if(strpbrk(rest, "\t\r\n")) //rejects input strings with tabs, carriage returns of new line characters
-        return make_response("Illegal IP address or port specified");
+#define SCAN_MAG_LIMIT ((uint64_t)1 << 63)  //one past LONG_MAX - magnitudes are clamped here
 
-    const char *sp = strchr(rest, ' ');  //sp is a pointer to the first blank space in the input string (in rest not request!)
-    if(!sp || sp != strrchr(rest, ' '))  //rejects strings with anything but exactly one blank space
-        return make_response("Illegal IP address or port specified");
+static void field_init(FieldScan *f, int is_ip, int allow_range) {
+    memset(f, 0, sizeof(*f));
+    f -> is_ip = is_ip;
+    f -> allow_range = allow_range;
+    f -> ok = 1;
+}
 
-    char ip_str[64], port_str[32];
-    if(sscanf(rest, "%63s %31s", ip_str, port_str) != 2)  //same job as sscanf in parse_rule - splits the input string into ip_str (ip address part) and port_str (port part)
-        return make_response("Illegal IP address or port specified");
+//converts the number just read the way glibc's %d does (strtol clamping, then truncation to int) and range-checks it
+static void field_finish_number(FieldScan *f) {
+    int64_t v;
+    if (f -> sign < 0)
+        v = f -> mag >= SCAN_MAG_LIMIT ? INT64_MIN : -(int64_t)f -> mag;
+    else
+        v = f -> mag >= SCAN_MAG_LIMIT ? INT64_MAX : (int64_t)f -> mag;
+    int n = (int)(uint32_t)(uint64_t)v;
 
-    uint32_t ip;
-    int port;
-    if (!parse_ip(ip_str, &ip) || !parse_port(port_str, &port))
-        return make_response("Illegal IP address or port specified");
-
-    for (size_t i = 0; i < rule_count; i++) { //loop through Rule structs
-        if (ip_in_range(ip, &rules[i]) && port_in_range(port, &rules[i])) { 
-            Rule *r = &rules[i];
-            //resize queries array to hold more Query structs, and store the result in tmp
-            if (r -> query_count == r -> query_cap) {
-                size_t new_cap;
-                    if (r -> query_cap == 0) {
-                        new_cap = 8;
-                    } else {
-                        new_cap = r -> query_cap * 2;
-                    }
-                Query *tmp = realloc(r -> queries, new_cap * sizeof(Query));  //resize requests array to hold new_cap pointers, and store the result in tmp
-                if (!tmp) { perror("realloc"); exit(1); }  //error handling for realloc - kills program immediately if tmp is NULL
-                r -> queries = tmp;  
-                r -> query_cap = new_cap;  
-            }
-            //writes the new Query struct into the empty slot in the queries array
-            r -> queries [r -> query_count].ip = ip;
-            r -> queries [r -> query_count].port = port;
-            r -> query_count++;
+    if (f -> is_ip) {
+        if (n < 0 || n > 255) f -> ok = 0;
+        f -> value[f -> half] = f -> value[f -> half] << 8 | (uint32_t)n;
+    } else {
+        if (n < 0 || n > 65535) f -> ok = 0;
+        f -> value[f -> half] = (uint32_t)n;
+    }
+    f -> sign = 0;
+    f -> digits = 0;
+    f -> mag = 0;
+}
+
+static void field_feed(FieldScan *f, char c) {
+    f -> started = 1;
+    if (!f -> ok)
+        return;
+
+    if (c >= '0' && c <= '9') {
+        if (f -> mag > SCAN_MAG_LIMIT / 10)
+            f -> mag = SCAN_MAG_LIMIT;  //clamped before mag * 10 can wrap around 64 bits
+        else
+            f -> mag = f -> mag * 10 + (uint64_t)(c - '0');
+        f -> digits++;
+        return;
+    }
+
+    if (f -> digits == 0) {
+        //at the start of a number: only an ip number may have a sign, and a '-' in the start half of a range is the separator rather than a sign
+        int is_sign = c == '+' || (c == '-' && !(f -> allow_range && f -> half == 0));
+        if (!f -> is_ip || f -> sign || !is_sign) { f -> ok = 0; return; }
+        f -> sign = c == '-' ? -1 : 1;
+        return;
+    }
+
+    field_finish_number(f);
+    if (f -> is_ip && f -> part < 3) {
+        if (c == '.') f -> part++;  //dots separate the four numbers of an address
+        else f -> ok = 0;
+    } else if (c == '-' && f -> allow_range && f -> half == 0) {
+        f -> half = 1;  //the start is complete, what follows is the end of the range
+        f -> part = 0;
+    } else {
+        f -> ok = 0;  //junk after a complete address or port
+    }
+}
+
+//called when the token ends - returns 1 if the token was valid, with start and end written to *start and *end
+static int field_end(FieldScan *f, uint32_t *start, uint32_t *end) {
+    if (!f -> ok || !f -> started || f -> digits == 0)
+        return 0;
+    field_finish_number(f);
+    if (!f -> ok || (f -> is_ip && f -> part != 3))
+        return 0;
 
-            return make_response("Connection accepted");
+    if (f -> half == 0) {
+        f -> value[1] = f -> value[0];  //a single address or port is a range of one
+    } else if (f -> value[0] >= f -> value[1]) {
+        return 0;  //a range must go upwards
+    }
+    *start = f -> value[0];
+    *end = f -> value[1];
+    return 1;
+}
+
+//reads "<ip> <port>" (or, with allow_range, "<ip>[-<ip>] <port>[-<port>]") from s into out in one pass
+//returns 1 on success, 0 if s is not a valid argument string
+static int scan_args(const char *s, int allow_range, Rule *out) {
+    FieldScan fields[2];
+    field_init(&fields[0], 1, allow_range);
+    field_init(&fields[1], 0, allow_range);
+
+    static const int limits[2] = { 63, 31 };  //the widths the old sscanf("%63s %31s") used
+    int spaces = 0, bad = 0;
+    int token = 0, token_len = 0;  //token is 0 for ip, 1 for port and 2 once both have been read
+
+    for (const char *p = s; *p; p++) {
+        char c = *p;
+        spaces += c == ' ';
+        bad |= c == '\t' || c == '\r' || c == '\n';
+
+        if (token == 2)
+            continue;  //only the space/tab/newline checks apply to the rest of the string
+
+        if (isspace((unsigned char)c)) {
+            if (token_len) { token++; token_len = 0; }  //whitespace ends the current token
+            continue;
         }
+
+        field_feed(&fields[token], c);
+        if (++token_len == limits[token]) { token++; token_len = 0; }  //width used up - the token ends here even if the characters carry on
     }
+    if (token_len)
+        token++;
 
-    return make_response("Connection rejected");
+    if (bad || spaces != 1 || token < 2)
+        return 0;
+
+    uint32_t ip_start, ip_end, port_start, port_end;
+    if (!field_end(&fields[0], &ip_start, &ip_end) || !field_end(&fields[1], &port_start, &port_end))
+        return 0;
+
+    out -> ip_start = ip_start;
+    out -> ip_end = ip_end;
+    out -> port_start = (int)port_start;
+    out -> port_end = (int)port_end;
+    return 1;  //represents success
 }
 
-//frees all heap-allocated memory and resests the program back to a clean state
-static char *handle_F(void) {
-    for (size_t i = 0; i < rule_count; i++) //loop through Rule structs
-        free(rules[i].queries); //free queries array inside each Rule struct
+static int parse_rule(const char *s, Rule *out) {
+    return scan_args(s, 1, out);
+}
 
-    free(rules); //free memory the rules pointer points to
-    rules = NULL; //rules is now a dangling pointer - set to NULL
-    rule_count = 0;
-    rule_cap = 0;
+// IPv6 arguments have the same "<ip>[-<ip>] <port>[-<port>]" shape, and are only tried once the IPv4 form has failed, so IPv4 requests never pay for them
+// they are read strictly: exactly one space, no tabs or line breaks, nothing after the port token, and ports are plain decimal from 0 to 65535
 
-    for (size_t i = 0; i < req_count; i++) //loop through all requests 
-        free(requests[i]); //free each request string
-    free(requests); //free memory the requests pointer points to 
-    requests = NULL;  //requests is now a dangling pointer - set to NULL
-    req_count = 0;
-    req_cap = 0;
+//reads the len characters at s as one IPv6 address - inet_pton does the parsing, so every RFC 4291 form is accepted, "::" and a trailing dotted quad included
+static int parse_ip6(const char *s, size_t len, Ip6 *out) {
+    char text[INET6_ADDRSTRLEN];
+    if (len == 0 || len >= sizeof(text))
+        return 0;
+    memcpy(text, s, len);
+    text[len] = '\0';
+    unsigned char b[16];
+    if (inet_pton(AF_INET6, text, b) != 1)
+        return 0;
+    out -> hi = out -> lo = 0;
+    for (int k = 0; k < 8; k++) {
+        out -> hi = out -> hi << 8 | b[k];
+        out -> lo = out -> lo << 8 | b[k + 8];
+    }
+    return 1;
+}
 
-    return make_response("All rules deleted");
+static int parse_port6(const char *s, size_t len, int *out) {
+    if (len == 0)
+        return 0;
+    uint32_t v = 0;
+    for (size_t k = 0; k < len; k++) {
+        if (s[k] < '0' || s[k] > '9')
+            return 0;
+        v = v * 10 + (uint32_t)(s[k] - '0');
+        if (v > 65535)
+            return 0;
+    }
+    *out = (int)v;
+    return 1;
 }
 
-//delete rule
-static char *handle_D(const char *request) {
-    const char *rule_str = request + 2;
+static int ip6_less(Ip6 a, Ip6 b) {
+    return a.hi < b.hi || (a.hi == b.hi && a.lo < b.lo);
+}
 
-    Rule r = {0};  //creates a temporary Rule struct on the stack called r and initializes all fields to 0
-    if (!parse_rule(rule_str, &r)) //parses rule_str and writes result at &r
-        return make_response("Invalid rule");
+//reads "<ip6> <port>" (or, with allow_range, "<ip6>[-<ip6>] <port>[-<port>]") from s into out
+//returns 1 on success, 0 if s is not a valid IPv6 argument string
+static int scan_args6(const char *s, int allow_range, Rule6 *out) {
+    if (!strchr(s, ':'))  //every IPv6 address has a ':' and no IPv4 one does
+        return 0;
+    const char *space = strchr(s, ' ');
+    if (!space || strchr(space + 1, ' ') || strpbrk(s, "\t\r\n"))
+        return 0;
 
-    //searches through Rule structs for exact match with the temporary rule just created
-    for (size_t i = 0; i < rule_count; i++) {
-        if (rules[i].ip_start == r.ip_start &&
-            rules[i].ip_end == r.ip_end &&
-            rules[i].port_start == r.port_start &&
-            rules[i].port_end == r.port_end) {
+    size_t ip_len = (size_t)(space - s);
+    const char *ip_dash = allow_range ? memchr(s, '-', ip_len) : NULL;
+    if (ip_dash) {
+        if (!parse_ip6(s, (size_t)(ip_dash - s), &out -> ip_start) || !parse_ip6(ip_dash + 1, (size_t)(space - ip_dash - 1), &out -> ip_end) ||
+            !ip6_less(out -> ip_start, out -> ip_end))  //a range must go upwards, as in the IPv4 form
+            return 0;
+    } else {
+        if (!parse_ip6(s, ip_len, &out -> ip_start))
+            return 0;
+        out -> ip_end = out -> ip_start;
+    }
 
-            //if found, frees that rule's queries
-            free(rules[i].queries);
+    const char *port = space + 1;
+    size_t port_len = strlen(port);
+    const char *port_dash = allow_range ? memchr(port, '-', port_len) : NULL;
+    if (port_dash) {
+        if (!parse_port6(port, (size_t)(port_dash - port), &out -> port_start) || !parse_port6(port_dash + 1, port_len - (size_t)(port_dash - port) - 1, &out -> port_end) ||
+            out -> port_start >= out -> port_end)
+            return 0;
+    } else {
+        if (!parse_port6(port, port_len, &out -> port_start))
+            return 0;
+        out -> port_end = out -> port_start;
+    }
+    return 1;
+}
 
-            //shifts remaining rules 
-            memmove(&rules[i], &rules[i+1], (rule_count - i - 1) *sizeof(Rule));
-            //memmove copies a block of memory from one location to another - It takes the destination, source and size (how many bytes to copy)
-            rule_count--;
+static int parse_rule6(const char *s, Rule6 *out) {
+    return scan_args6(s, 1, out);
+}
 
-            return make_response("Rule deleted");
-            }
-    }  
+//the heap priority of the node for seq - a splitmix64 finish, so priorities look random whatever order rules arrive in
+static uint64_t index_priority(uint64_t seq) {
+    uint64_t h = seq * 0x9E3779B97F4A7C15ull;
+    h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ull;
+    h = (h ^ (h >> 27)) * 0x94D049BB133111EBull;
+    return h ^ (h >> 31);
+}
 
-    return make_response("Rule not found");
-}  //temporary rule on stack deleted when the function returns
+//recomputes the subtree summaries of n from its own range and its children
+static void index_update(IndexNode *n) {
+    n -> max_end = n -> ip_end;
+    n -> min_seq = n -> seq;
+    if (n -> left) {
+        if (n -> left -> max_end > n -> max_end) n -> max_end = n -> left -> max_end;
+        if (n -> left -> min_seq < n -> min_seq) n -> min_seq = n -> left -> min_seq;
+    }
+    if (n -> right) {
+        if (n -> right -> max_end > n -> max_end) n -> max_end = n -> right -> max_end;
+        if (n -> right -> min_seq < n -> min_seq) n -> min_seq = n -> right -> min_seq;
+    }
+}
 
-//builds and returns a string that stores every rule, and under each rule, every query that matched it 
-static char *handle_L(void) {
-    if (rule_count == 0)
-        return make_response("");
+static int index_less(uint32_t ip_a, uint64_t seq_a, uint32_t ip_b, uint64_t seq_b) {
+    return ip_a < ip_b || (ip_a == ip_b && seq_a < seq_b);  //nodes are ordered by ip_start, ties broken by seq
+}
 
-    //first pass: calculates number of bytes required to store string
-    size_t total = 0; //total tracks necessary number of bytes to store string
-    for(size_t i = 0; i < rule_count; i++) {
-        Rule *r = &rules[i];
+static IndexNode *index_rotate_right(IndexNode *n) {
+    IndexNode *l = n -> left;
+    n -> left = l -> right;
+    l -> right = n;
+    index_update(n);
+    index_update(l);
+    return l;
+}
 
-        char ip1[16], ip2[16]; 
-        ip_to_str(r -> ip_start, ip1); //converts 32-bit int for each rule to formatted ip string and writes to ip1 (ip_start is the first ip in allowed range)
-        ip_to_str(r -> ip_end, ip2); //converts 32-bit int for each rule to formatted ip string and writes to ip2 (ip_end is the second ip in allowed range OR the same as ip_start if there is only one allowed ip in rule)
+static IndexNode *index_rotate_left(IndexNode *n) {
+    IndexNode *r = n -> right;
+    n -> right = r -> left;
+    r -> left = n;
+    index_update(n);
+    index_update(r);
+    return r;
+}
 
-        if (r -> ip_start == r -> ip_end) //if the rule allows a single valid ip (ip_start and ip_end hold the same value)
-            total += strlen("Rule: ") + strlen(ip1);
-        else //if the rule allows a range of valid ips
-            total += strlen("Rule: ") + strlen(ip1) + 1 + strlen(ip2);
+static IndexNode *index_insert(IndexNode *root, IndexNode *node) {
+    if (!root)
+        return node;
 
-        if (r -> port_start == r -> port_end) //if the rule allows a single valid port
-            total += 1 + 5; //(space between ip and port + port)
-        else //if the rule allows a range of valid ports
-            total += 1 + 5 + 1 + 5; //(space between ip and port + port + '-' + port)
+    if (index_less(node -> ip_start, node -> seq, root -> ip_start, root -> seq)) {
+        root -> left = index_insert(root -> left, node);
+        if (index_priority(root -> left -> seq) > index_priority(root -> seq))  //restore the heap property on the way back up
+            root = index_rotate_right(root);
+    } else {
+        root -> right = index_insert(root -> right, node);
+        if (index_priority(root -> right -> seq) > index_priority(root -> seq))
+            root = index_rotate_left(root);
+    }
+    index_update(root);
+    return root;
+}
 
-        total += 1; //total + '\n'
+//removes the node for the rule with this ip_start and seq - the node is rotated down until it is a leaf and then freed
+static IndexNode *index_remove(IndexNode *root, uint32_t ip_start, uint64_t seq) {
+    if (!root)
+        return NULL;
 
-        for (size_t j = 0; j < r -> query_count; j++) {
-            char qip[16]; //declares 16 byte buffer to store each query's formatted ip which has been accepted by each rule
-            ip_to_str(r -> queries[j].ip, qip); //writes formatted ip for each query to qip
-            total += strlen("Query: ") + strlen(qip) + 1 + 5 + 1; //calculates bytes needed to store each Query 
+    if (root -> seq == seq) {
+        if (!root -> left || !root -> right) {
+            IndexNode *child = root -> left ? root -> left : root -> right;
+            arena_free(root);
+            return child;
+        }
+        if (index_priority(root -> left -> seq) > index_priority(root -> right -> seq)) {
+            root = index_rotate_right(root);
+            root -> right = index_remove(root -> right, ip_start, seq);
+        } else {
+            root = index_rotate_left(root);
+            root -> left = index_remove(root -> left, ip_start, seq);
         }
+    } else if (index_less(ip_start, seq, root -> ip_start, root -> seq)) {
+        root -> left = index_remove(root -> left, ip_start, seq);
+    } else {
+        root -> right = index_remove(root -> right, ip_start, seq);
     }
+    index_update(root);
+    return root;
+}
 
-    char *response = malloc(total + 1); //allocates enough memory on the heap to store total + '\0' and returns pointer to it called response
-    if (!response) { perror("malloc");  exit(1); }
+static void index_add(Shard *s, const Rule *r, uint64_t seq, QueryHistory *history) {
+    IndexNode *node = arena_alloc(sizeof(IndexNode));
 
-    char *p = response; //creates pointer to the same location as response for the second pass
-    //second pass: writes string 
-    for (size_t i = 0; i < rule_count; i++) {
-        Rule *r = &rules[i];
+    node -> ip_start = r -> ip_start;
+    node -> ip_end = r -> ip_end;
+    node -> port_start = (uint16_t)r -> port_start;
+    node -> port_end = (uint16_t)r -> port_end;
+    node -> seq = seq;
+    node -> history = history;
+    node -> left = node -> right = NULL;
+    index_update(node);
 
-        char ip1[16], ip2[16];
-        ip_to_str(r -> ip_start, ip1);
-        ip_to_str(r -> ip_end, ip2);
+    s -> index = index_insert(s -> index, node);
+}
 
-        if (r -> ip_start == r -> ip_end)
-            p += sprintf(p, "Rule: %s", ip1); //calls sprintf on parameters (returns length of output) and moves p pointer along by that number of characters to the next empty slot
-        else
-            p += sprintf(p, "Rule: %s-%s", ip1, ip2);
+//links nodes[0 .. count), which are sorted by (ip_start, seq), into a treap in one sweep and returns its root
+//stack holds the right spine built so far: each node pops the lower-priority nodes off it as its left subtree, and a node's summaries are worked out as it leaves the spine, by which time its subtrees are finished
+static IndexNode *index_build(IndexNode **nodes, size_t count, IndexNode **stack) {
+    size_t top = 0;
+    for (size_t k = 0; k < count; k++) {
+        IndexNode *node = nodes[k], *last = NULL;
+        while (top && index_priority(stack[top - 1] -> seq) < index_priority(node -> seq)) {
+            last = stack[--top];
+            index_update(last);
+        }
+        node -> left = last;
+        if (top)
+            stack[top - 1] -> right = node;
+        stack[top++] = node;
+    }
+    while (top > 1)
+        index_update(stack[--top]);
+    if (!top)
+        return NULL;
+    index_update(stack[0]);
+    return stack[0];
+}
 
-        if (r -> port_start == r -> port_end)
-            p += sprintf(p, "%d\n", r -> port_start);
-        else
-            p += sprintf(p, "%d-%d\n", r -> port_start, r -> port_end);
+//finds the smallest seq of any rule containing both ip and port and stores it in *best, and that rule's history in *history
+//subtrees are skipped when every range in them ends before ip, or when none of their seqs can beat *best
+static void index_lookup(const IndexNode *n, uint32_t ip, int port, uint64_t *best, QueryHistory **history) {
+    while (n && n -> max_end >= ip && n -> min_seq < *best) {
+        STAT_STEP();
+        index_lookup(n -> left, ip, port, best, history);
 
-        for (size_t j = 0; j < r -> query_count; j++) {
-            char qip[16];
-            ip_to_str(r -> queries[j].ip, qip);
-            p += sprintf(p, "Query: %s %d\n", qip, r -> queries[j].port);
+        if (n -> ip_start > ip)  //everything to the right starts even later, so it cannot contain ip
+            return;
+
+        if (n -> seq < *best && ip <= n -> ip_end &&
+            port >= n -> port_start && port <= n -> port_end) {
+            *best = n -> seq;
+            *history = n -> history;
         }
+
+        n = n -> right;  //loop instead of recursing on the right child
     }
-    *p = '\0';
+}
 
-    return response;
+//returns the prefix length of r's ip range if it is a CIDR block (ip_start aligned to its size, which is a power of 2), or -1 if it is not
+static int prefix_length(const Rule *r) {
+    uint64_t size = (uint64_t)r -> ip_end - r -> ip_start + 1;
+    if (size & (size - 1))
+        return -1;
+    if (r -> ip_start & (uint32_t)(size - 1))
+        return -1;
+    int len = 32;
+    while (size > 1) {
+        size >>= 1;
+        len--;
     }
-    
-    char *processRequest(char *request) { 
-
-        //trim trailing whitespace characters
-        size_t len = strlen(request);
-        while(len < 0 && isspace((unsigned char)request[len - 1])) //while request is non-empty and last character is whitespace/trailing character - keep going
-        //isspace returns true for any whitespace character: space ' ', tab '\t', newline '\n', carriage return '\r', vertical tab '\v', and form feed '\f'
-            request[len--] = '\0'; //overwrite any whitespace characters at the end of request string with '\0'
-
-        pthread_mutex_lock(&global_lock);  //ensures that if two threads call processRequest at the same time, only one can be inside the critical section at a time
-        log_request(request);
-            
-        char *response;
-
-        if (strcmp(request, "R" ) == 0)  //R takes no arguments - if statement returns 1/true if strings match (0 == 0)
-            response = handle_R();
-        else if (strncmp(request, "A ", 2) == 0) //if statement returns true if first 2 characters of strings match (0 == 0)
-        /* strncmp(string1, string2, n): n = how many characters to check, starting from the beginning */
-            response = handle_A(request);
-        else if (strncmp(request, "C ", 2) == 0) //if statement returns true if first 2 characters of strings match (0 == 0)
-            response = handle_C(request);
-        else if (strcmp(request, "F" ) == 0)  //F takes no arguments  - if statement returns 1/true if strings match (0 == 0)
-            response = handle_F();
-        else if (strncmp(request, "D ", 2) == 0) //if statement returns true if first 2 characters of strings match (0 == 0)
-            response = handle_D(request);
-        else if (strcmp(request, "L" ) == 0)  //L takes no arguments  - if statement returns 1/true if strings match (0 == 0)
-            response = handle_L();
-
-        pthread_mutex_unlock(&global_lock);
-        return response;
+    return len;
+}
+
+static int prefix_has(const uint64_t *bits, unsigned slot) {
+    return (int)(bits[slot >> 6] >> (slot & 63) & 1);
+}
+
+//how many of the slots before slot are set in bits - the position of slot's child or list in the packed array
+static unsigned prefix_rank(const uint64_t *bits, unsigned slot) {
+    unsigned rank = 0;
+    for (unsigned w = 0; w < slot >> 6; w++)
+        rank += (unsigned)__builtin_popcountll(bits[w]);
+    if (slot & 63)
+        rank += (unsigned)__builtin_popcountll(bits[slot >> 6] & ((1ull << (slot & 63)) - 1));
+    return rank;
+}
+
+static unsigned prefix_count(const uint64_t *bits) {
+    return (unsigned)(__builtin_popcountll(bits[0]) + __builtin_popcountll(bits[1]) + __builtin_popcountll(bits[2]) + __builtin_popcountll(bits[3]));
+}
+
+//opens a gap of one element at position at in a packed array that currently holds n elements of the given size
+static void *prefix_array_insert(void *array, unsigned n, unsigned at, size_t size) {
+    char *a = arena_realloc(array, n * size, (n + 1) * size);
+    memmove(a + (at + 1) * size, a + at * size, (n - at) * size);
+    return a;
+}
+
+//closes the gap left by taking the element at position at out of a packed array that held n elements of the given size
+static void prefix_array_remove(void *array, unsigned n, unsigned at, size_t size) {
+    char *a = array;
+    memmove(a + at * size, a + (at + 1) * size, (n - at - 1) * size);
+}
+
+static PrefixNode *prefix_node_new(void) {
+    return arena_zalloc(sizeof(PrefixNode));
+}
+
+//returns the list in slot of n, creating an empty one if there is none
+static PrefixList *prefix_list_at(PrefixNode *n, unsigned slot) {
+    unsigned at = prefix_rank(n -> list_bits, slot);
+    if (!prefix_has(n -> list_bits, slot)) {
+        n -> lists = prefix_array_insert(n -> lists, prefix_count(n -> list_bits), at, sizeof(PrefixList));
+        n -> lists[at] = (PrefixList){0};
+        n -> list_bits[slot >> 6] |= 1ull << (slot & 63);
+    }
+    return &n -> lists[at];
+}
+
+//returns the child in slot of n, creating it if there is none
+static PrefixNode *prefix_child_at(PrefixNode *n, unsigned slot) {
+    unsigned at = prefix_rank(n -> child_bits, slot);
+    if (!prefix_has(n -> child_bits, slot)) {
+        n -> children = prefix_array_insert(n -> children, prefix_count(n -> child_bits), at, sizeof(PrefixNode *));
+        n -> children[at] = prefix_node_new();
+        n -> child_bits[slot >> 6] |= 1ull << (slot & 63);
+    }
+    return n -> children[at];
+}
+
+//the level of the trie a /len block is stored at, and how many slots of that level it covers
+static int prefix_level(int len) {
+    return len == 0 ? 0 : (len - 1) / 8;
+}
+
+static unsigned prefix_span(int len) {
+    return 1u << (8 * (prefix_level(len) + 1) - len);
+}
+
+//adds a rule whose ip range is the /len block starting at r -> ip_start to the trie of shard s
+static void prefix_add(Shard *s, const Rule *r, int len, uint64_t seq, QueryHistory *history) {
+    int level = prefix_level(len);
+    if (!s -> prefix)
+        s -> prefix = prefix_node_new();
+    PrefixNode *n = s -> prefix;
+    for (int d = 0; d < level; d++)
+        n = prefix_child_at(n, r -> ip_start >> (24 - 8 * d) & 255);
+
+    unsigned first = r -> ip_start >> (24 - 8 * level) & 255;
+    for (unsigned slot = first; slot < first + prefix_span(len); slot++) {
+        PrefixList *l = prefix_list_at(n, slot);
+        if (l -> count == l -> cap) {
+            uint32_t new_cap = l -> cap ? l -> cap * 2 : 2;
+            l -> entries = arena_realloc(l -> entries, l -> cap * sizeof(PrefixEntry), new_cap * sizeof(PrefixEntry));
+            l -> cap = new_cap;
+        }
+        uint32_t k = l -> count++;
+        while (k > 0 && l -> entries[k - 1].seq > seq) {  //rules are added in seq order, so this only moves anything if that ever changes
+            l -> entries[k] = l -> entries[k - 1];
+            k--;
+        }
+        l -> entries[k] = (PrefixEntry){ seq, history, r -> port_start, r -> port_end };
     }
+}
+
+static int prefix_node_empty(const PrefixNode *n) {
+    return prefix_count(n -> child_bits) == 0 && prefix_count(n -> list_bits) == 0;
+}
 
+//removes the rule with this seq (a /len block starting at ip_start) from the subtree under n, which is at level d
+//lists and nodes left empty are freed - returns 1 if that includes n itself
+static int prefix_remove(PrefixNode *n, int d, uint32_t ip_start, int len, uint64_t seq) {
+    int level = prefix_level(len);
+    if (d < level) {
+        unsigned slot = ip_start >> (24 - 8 * d) & 255;
+        if (!prefix_has(n -> child_bits, slot))
+            return 0;
+        unsigned at = prefix_rank(n -> child_bits, slot);
+        if (prefix_remove(n -> children[at], d + 1, ip_start, len, seq)) {
+            prefix_array_remove(n -> children, prefix_count(n -> child_bits), at, sizeof(PrefixNode *));
+            n -> child_bits[slot >> 6] &= ~(1ull << (slot & 63));
+        }
+    } else {
+        unsigned first = ip_start >> (24 - 8 * level) & 255;
+        for (unsigned slot = first; slot < first + prefix_span(len); slot++) {
+            if (!prefix_has(n -> list_bits, slot))
+                continue;
+            unsigned at = prefix_rank(n -> list_bits, slot);
+            PrefixList *l = &n -> lists[at];
+            for (uint32_t k = 0; k < l -> count; k++) {
+                if (l -> entries[k].seq == seq) {
+                    memmove(&l -> entries[k], &l -> entries[k + 1], (l -> count - k - 1) * sizeof(PrefixEntry));
+                    l -> count--;
+                    break;
+                }
+            }
+            if (l -> count == 0) {
+                arena_free(l -> entries);
+                prefix_array_remove(n -> lists, prefix_count(n -> list_bits), at, sizeof(PrefixList));
+                n -> list_bits[slot >> 6] &= ~(1ull << (slot & 63));
+            }
+        }
+    }
 
-        
-    
-    
-        
+    if (!prefix_node_empty(n))
+        return 0;
+    arena_free(n -> lists);
+    arena_free(n -> children);
+    arena_free(n);
+    return 1;
+}
 
-    
+// PrefixPiece is one CIDR-aligned shard piece waiting to go into a trie that is being built in one go
+typedef struct {
+    uint32_t ip_start;
+    int len;
+    PrefixEntry entry;
+} PrefixPiece;
 
+//fills in trie node n at level d with pieces[0 .. count), which are in seq order and all fall under n
+//every list and packed array is allocated once at its final size, and the pieces left for the next level are split by their byte with a counting sort into scratch,
+//which keeps them in seq order - pieces itself then serves as the scratch space one level down
+//only the slots in use are visited, through the bitmaps, since most nodes deep in a trie hold a handful of pieces
+static void prefix_build(PrefixNode *n, int d, PrefixPiece *pieces, size_t count, PrefixPiece *scratch) {
+    uint32_t list_len[256];  //like the arrays below, only read for slots whose bit is set
+    size_t child_len[256];
+    for (size_t k = 0; k < count; k++) {
+        unsigned slot = pieces[k].ip_start >> (24 - 8 * d) & 255;
+        if (prefix_level(pieces[k].len) != d) {
+            if (!prefix_has(n -> child_bits, slot)) {
+                n -> child_bits[slot >> 6] |= 1ull << (slot & 63);
+                child_len[slot] = 0;
+            }
+            child_len[slot]++;
+            continue;
+        }
+        for (unsigned t = slot; t < slot + prefix_span(pieces[k].len); t++) {
+            if (!prefix_has(n -> list_bits, t)) {
+                n -> list_bits[t >> 6] |= 1ull << (t & 63);
+                list_len[t] = 0;
+            }
+            list_len[t]++;
+        }
+    }
+
+    unsigned lists = prefix_count(n -> list_bits), at = 0;
+    unsigned list_at[256];
+    if (lists) {
+        n -> lists = arena_alloc(lists * sizeof(PrefixList));
+        for (unsigned w = 0; w < 4; w++)
+            for (uint64_t bits = n -> list_bits[w]; bits; bits &= bits - 1) {
+                unsigned slot = w * 64 + (unsigned)__builtin_ctzll(bits);
+                PrefixList *l = &n -> lists[at];
+                list_at[slot] = at++;
+                l -> entries = arena_alloc(list_len[slot] * sizeof(PrefixEntry));
+                l -> count = 0;
+                l -> cap = list_len[slot];
+            }
+        for (size_t k = 0; k < count; k++) {
+            if (prefix_level(pieces[k].len) != d)
+                continue;
+            unsigned slot = pieces[k].ip_start >> (24 - 8 * d) & 255;
+            for (unsigned t = slot; t < slot + prefix_span(pieces[k].len); t++) {
+                PrefixList *l = &n -> lists[list_at[t]];
+                l -> entries[l -> count++] = pieces[k].entry;
+            }
+        }
+    }
+
+    unsigned children = prefix_count(n -> child_bits);
+    if (!children)
+        return;
+    size_t child_start[256], fill[256], start = 0;
+    for (unsigned w = 0; w < 4; w++)
+        for (uint64_t bits = n -> child_bits[w]; bits; bits &= bits - 1) {
+            unsigned slot = w * 64 + (unsigned)__builtin_ctzll(bits);
+            child_start[slot] = fill[slot] = start;
+            start += child_len[slot];
+        }
+    for (size_t k = 0; k < count; k++)
+        if (prefix_level(pieces[k].len) != d)
+            scratch[fill[pieces[k].ip_start >> (24 - 8 * d) & 255]++] = pieces[k];
+
+    n -> children = arena_alloc(children * sizeof(PrefixNode *));
+    at = 0;
+    for (unsigned w = 0; w < 4; w++)
+        for (uint64_t bits = n -> child_bits[w]; bits; bits &= bits - 1) {
+            unsigned slot = w * 64 + (unsigned)__builtin_ctzll(bits);
+            PrefixNode *child = prefix_node_new();
+            n -> children[at++] = child;
+            prefix_build(child, d + 1, scratch + child_start[slot], child_len[slot], pieces + child_start[slot]);
+        }
+}
+
+//lowers *best to the smallest seq of any CIDR-aligned rule containing both ip and port, and stores that rule's history in *history
+//one slot per level, found with a bitmap test and a popcount - the walk stops at the first level with no child for ip's next byte
+static void prefix_lookup(const PrefixNode *n, uint32_t ip, int port, uint64_t *best, QueryHistory **history) {
+    for (int d = 0; n && d < 4; d++) {
+        unsigned slot = ip >> (24 - 8 * d) & 255;
+        if (prefix_has(n -> list_bits, slot)) {
+            const PrefixList *l = &n -> lists[prefix_rank(n -> list_bits, slot)];
+            for (uint32_t k = 0; k < l -> count && l -> entries[k].seq < *best; k++) {
+                STAT_STEP();
+                if (port >= l -> entries[k].port_start && port <= l -> entries[k].port_end) {
+                    *best = l -> entries[k].seq;
+                    *history = l -> entries[k].history;
+                    break;
+                }
+            }
+        }
+        n = prefix_has(n -> child_bits, slot) ? n -> children[prefix_rank(n -> child_bits, slot)] : NULL;
+    }
+}
+
+//the part of r that falls in shard s - its ip range cut down to the shard's ips
+//a CIDR block stays one when it is cut, so a rule spanning shards lands in each shard's trie or index the same way every time
+static Rule shard_piece(const Rule *r, unsigned s) {
+    uint32_t lo = (uint32_t)s << (32 - SHARD_BITS), hi = lo | (UINT32_MAX >> SHARD_BITS);
+    Rule piece = *r;
+    if (piece.ip_start < lo)
+        piece.ip_start = lo;
+    if (piece.ip_end > hi)
+        piece.ip_end = hi;
+    return piece;
+}
+
+//adds a rule to every shard its ip range falls in - to the shard's prefix trie where its piece is a CIDR block, and to the shard's rule index otherwise
+static void lookup_add(const Rule *r, uint64_t seq, QueryHistory *history) {
+    for (unsigned s = shard_of(r -> ip_start); s <= shard_of(r -> ip_end); s++) {
+        shards[s].generation++;
+        Rule piece = shard_piece(r, s);
+        int len = prefix_length(&piece);
+        if (len >= 0)
+            prefix_add(&shards[s], &piece, len, seq, history);
+        else
+            index_add(&shards[s], &piece, seq, history);
+    }
+}
+
+//takes the rule at position i of the rules table out of every shard that holds a piece of it
+static void lookup_remove(size_t i) {
+    Rule r = { rules.ip_start[i], rules.ip_end[i], rules.port_start[i], rules.port_end[i] };
+    for (unsigned s = shard_of(r.ip_start); s <= shard_of(r.ip_end); s++) {
+        Shard *sh = &shards[s];
+        sh -> generation++;
+        Rule piece = shard_piece(&r, s);
+        int len = prefix_length(&piece);
+        if (len < 0)
+            sh -> index = index_remove(sh -> index, piece.ip_start, rules.seq[i]);
+        else if (sh -> prefix && prefix_remove(sh -> prefix, 0, piece.ip_start, len, rules.seq[i]))
+            sh -> prefix = NULL;
+    }
+}
+
+//the rules table is kept in insertion order, so its seq column is sorted and can be binary searched
+static size_t find_rule_by_seq(uint64_t seq) {
+    size_t lo = 0, hi = rules.count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (rules.seq[mid] < seq)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static char *make_response(const char *s) {  //called whenever a response string has to be handed back on the heap 
+    char *r = strdup(s);  //allocates enough heap memory to fit the input string, copies it in, and returns a pointer to it - that pointer gets stored in r and returned
+    if (!r) { perror("strdup"); exit(1); }  //error handling for strdup - kills program immediately if strdup can't allocate memory for a response string 
+    stat_alloc();
+    return r;
+}
+
+// L prints an address and at least one port for every rule and query, so numbers are formatted from lookup tables instead of with sprintf
+// digit_pairs holds "00" to "99" back to back, and octet_text holds the digits of every octet 0-255 with the digit count in the last byte
+static const char digit_pairs[] =
+    "0001020304050607080910111213141516171819202122232425262728293031323334353637383940414243444546474849"
+    "5051525354555657585960616263646566676869707172737475767778798081828384858687888990919293949596979899";
+static char octet_text[256][4];
+static pthread_once_t format_once = PTHREAD_ONCE_INIT;
+
+static void format_init(void) {
+    for (int v = 0; v < 256; v++) {
+        char *t = octet_text[v];
+        if (v >= 100) {
+            t[0] = (char)('0' + v / 100);
+            memcpy(t + 1, digit_pairs + 2 * (v % 100), 2);
+            t[3] = 3;
+        } else if (v >= 10) {
+            memcpy(t, digit_pairs + 2 * v, 2);
+            t[3] = 2;
+        } else {
+            t[0] = (char)('0' + v);
+            t[3] = 1;
+        }
+    }
+}
+
+//writes ip as a dotted quad at out and returns its length - no '\0' is added, and out needs room for 16 bytes because each octet is copied as a whole table entry
+static size_t format_ip(uint32_t ip, char *out) {
+    char *p = out;
+    for (int shift = 24; shift >= 0; shift -= 8) {
+        const char *t = octet_text[(ip >> shift) & 0xFF];  //shifting then & 0xFF isolates each 8 bit chunk
+        memcpy(p, t, 4);
+        p += t[3];
+        *p = '.';
+        p += shift > 0;  //no dot after the last octet
+    }
+    return (size_t)(p - out);
+}
+
+//writes ip in the RFC 5952 form at out and returns its length - no '\0' is added, and out needs room for 39 bytes
+//groups are lowercase hex without leading zeros, and the longest run of two or more zero groups (the first, if there is a tie) is written as "::"
+//IPv4-mapped addresses keep their dotted quad, as "::ffff:1.2.3.4"
+static size_t format_ip6(Ip6 ip, char *out) {
+    static const char hex[] = "0123456789abcdef";
+    if (ip.hi == 0 && ip.lo >> 32 == 0xffff) {
+        memcpy(out, "::ffff:", 7);
+        return 7 + format_ip((uint32_t)ip.lo, out + 7);
+    }
+    uint16_t g[8];
+    for (int k = 0; k < 4; k++) {
+        g[k] = (uint16_t)(ip.hi >> (48 - 16 * k));
+        g[k + 4] = (uint16_t)(ip.lo >> (48 - 16 * k));
+    }
+
+    int best = -1, best_len = 1;  //a single zero group is written as "0", not compressed
+    for (int k = 0; k < 8; ) {
+        int len = 0;
+        while (k + len < 8 && g[k + len] == 0)
+            len++;
+        if (len > best_len)
+            best = k, best_len = len;
+        k += len ? len : 1;
+    }
+
+    char *p = out;
+    for (int k = 0; k < 8; k++) {
+        if (k == best) {
+            *p++ = ':';
+            *p++ = ':';
+            k += best_len - 1;
+            continue;
+        }
+        if (k > 0 && k != best + best_len)  //no ':' straight after the "::"
+            *p++ = ':';
+        int shift = 12;
+        while (shift > 0 && (g[k] >> shift) == 0)
+            shift -= 4;
+        for (; shift >= 0; shift -= 4)
+            *p++ = hex[(g[k] >> shift) & 15];
+    }
+    return (size_t)(p - out);
+}
+
+//writes v in decimal at out and returns its length - no '\0' is added
+static size_t format_uint(uint32_t v, char *out) {
+    char tmp[10];  //the most digits a uint32_t can have
+    char *p = tmp + sizeof(tmp);
+    while (v >= 100) {  //two digits at a time, from the right
+        p -= 2;
+        memcpy(p, digit_pairs + 2 * (v % 100), 2);
+        v /= 100;
+    }
+    if (v >= 10) {
+        p -= 2;
+        memcpy(p, digit_pairs + 2 * v, 2);
+    } else {
+        *--p = (char)('0' + v);
+    }
+    size_t len = (size_t)(tmp + sizeof(tmp) - p);
+    memcpy(out, p, len);
+    return len;
+}
+
+#define LOG_CHUNK_SIZE (64 * 1024)
+#define LOG_END UINT32_MAX  //header written where an entry did not fit, telling readers to move on to the next chunk
+
+static LogChunk *log_chunk_new(size_t size) {
+    LogChunk *c = arena_alloc(sizeof(LogChunk) + size);
+    size = arena_usable(c) - sizeof(LogChunk);  //use the whole block the arena handed out
+    memset(c, 0, sizeof(LogChunk) + size);  //so every header starts as 0 (not written yet)
+    c -> size = size;
+    return c;
+}
+
+static void log_init(void) {
+    log_head = log_chunk_new(LOG_CHUNK_SIZE);
+    atomic_store(&log_tail, log_head);
+}
+
+static _Atomic uint32_t *log_header(LogChunk *c, size_t offset) {
+    return (_Atomic uint32_t *)(c -> data + offset);
+}
+
+//called by an appender whose reservation ran off the end of c - links a new chunk after c (unless another thread already has) and moves log_tail on to it
+static void log_grow(LogChunk *c, size_t need) {
+    LogChunk *next = atomic_load(&c -> next);
+    if (!next) {
+        LogChunk *fresh = log_chunk_new(need > LOG_CHUNK_SIZE ? need : LOG_CHUNK_SIZE);  //oversized requests get a chunk of their own
+        LogChunk *expected = NULL;
+        if (atomic_compare_exchange_strong(&c -> next, &expected, fresh)) {
+            next = fresh;
+        } else {
+            arena_free(fresh);  //another thread won the race
+            next = expected;
+        }
+    }
+    atomic_compare_exchange_strong(&log_tail, &c, next);
+}
+
+//keeps a record of every request that comes into the server in the order they arrived 
+//appenders never block each other: each one reserves space in the current chunk with an atomic fetch-add and copies its request in
+//returns the position the request was logged at
+static LogPos log_request(const char *request, size_t len) {
+    pthread_once(&log_once, log_init);
+
+    size_t need = (sizeof(uint32_t) + len + 3) & ~(size_t)3;  //header + bytes, rounded up so the next header stays 4-byte aligned
+
+    for (;;) {
+        LogChunk *c = atomic_load_explicit(&log_tail, memory_order_acquire);
+        size_t off = atomic_fetch_add_explicit(&c -> used, need, memory_order_relaxed);
+
+        if (off + need <= c -> size) {
+            memcpy(c -> data + off + sizeof(uint32_t), request, len);
+            atomic_store_explicit(log_header(c, off), (uint32_t)len + 1, memory_order_release);  //publish the entry only once its bytes are in place
+            return (LogPos){ c, off };
+        }
+
+        if (off + sizeof(uint32_t) <= c -> size)  //this reservation is the one that crossed the end of the chunk, so it marks where the entries stop
+            atomic_store_explicit(log_header(c, off), LOG_END, memory_order_release);
+        log_grow(c, need);
+    }
+}
+
+//waits for the entry at offset to be published and returns its header
+static uint32_t log_wait(LogChunk *c, size_t offset) {
+    uint32_t h;
+    while ((h = atomic_load_explicit(log_header(c, offset), memory_order_acquire)) == 0)
+        sched_yield();  //space is reserved but the appender has not finished copying yet
+    return h;
+}
+
+//copies out as much of the entries from l -> pos up to and including l -> upto as fits in cap bytes, one per line
+//returns the number of bytes written to buf
+static size_t listing_read_log(Listing *l, char *buf, size_t cap) {
+    if (l -> generation != log_generation) {  //an F has freed the entries this listing was walking
+        l -> done = 1;
+        return 0;
+    }
+
+    size_t n = 0;
+    while (n < cap) {
+        LogChunk *c = l -> pos.chunk;
+        uint32_t h = l -> pos.offset + sizeof(uint32_t) <= c -> size ? log_wait(c, l -> pos.offset) : LOG_END;
+        if (h == LOG_END) {  //the entries carry on at the start of the next chunk
+            l -> pos = (LogPos){ atomic_load(&c -> next), 0 };
+            continue;
+        }
+
+        size_t len = h - 1;
+        const unsigned char *entry = c -> data + l -> pos.offset + sizeof(uint32_t);
+        size_t take = len + 1 - l -> part;  //what is left of the entry, its '\n' included
+        if (take > cap - n)
+            take = cap - n;
+        if (l -> part + take > len) {  //reaches the end of the entry
+            memcpy(buf + n, entry + l -> part, len - l -> part);
+            buf[n + take - 1] = '\n';
+        } else {
+            memcpy(buf + n, entry + l -> part, take);
+        }
+        n += take;
+        l -> part += take;
+        if (l -> part <= len)
+            break;  //buf is full partway through the entry
+
+        if (c == l -> upto.chunk && l -> pos.offset == l -> upto.offset) {
+            l -> done = 1;
+            break;
+        }
+        l -> pos.offset += (sizeof(uint32_t) + len + 3) & ~(size_t)3;
+        l -> part = 0;
+    }
+    return n;
+}
+
+//fsyncs the directory holding path, so that a file just created or renamed there survives a crash
+static void sync_parent_dir(const char *path) {
+    const char *slash = strrchr(path, '/');
+    char dir[4096] = ".";
+    if (slash) {
+        size_t len = slash == path ? 1 : (size_t)(slash - path);
+        if (len >= sizeof(dir))
+            return;
+        memcpy(dir, path, len);
+        dir[len] = '\0';
+    }
+    int fd = open(dir, O_RDONLY | O_DIRECTORY);
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+}
+
+static uint32_t wal_hash(uint32_t h, const void *data, size_t n) {
+    const unsigned char *p = data;
+    for (size_t k = 0; k < n; k++)
+        h = (h ^ p[k]) * 16777619u;
+    return h;
+}
+
+static uint32_t wal_check(const WalRecord *rec, const char *text) {
+    uint32_t h = wal_hash(2166136261u, (const char *)rec + sizeof(rec -> check), sizeof(*rec) - sizeof(rec -> check));
+    return wal_hash(h, text, rec -> text_len);
+}
+
+//appends a record of a change to the rules (r is NULL for F) to the write-ahead log, without waiting for it to reach the disk
+//called with rules_lock held for writing, so records are in the same order as the changes
+//returns the record's lsn, to be passed to wal_commit once rules_lock has been released - or 0 if there is no write-ahead log
+static uint64_t wal_append(char op, const Rule *r, const char *text, size_t len) {
+    if (wal_fd < 0)
+        return 0;
+
+    WalRecord rec = {0};
+    rec.text_len = (uint32_t)len;
+    rec.lsn = ++wal_lsn;
+    rec.op = (uint32_t)op;
+    if (r) {
+        rec.ip_start = r -> ip_start;
+        rec.ip_end = r -> ip_end;
+        rec.port_start = (uint16_t)r -> port_start;
+        rec.port_end = (uint16_t)r -> port_end;
+    }
+    rec.check = wal_check(&rec, text);
+
+    pthread_mutex_lock(&wal_mutex);
+    WalBuffer *b = &wal_pending;
+    if (b -> len + sizeof(rec) + len > b -> cap) {
+        size_t new_cap = b -> cap ? b -> cap * 2 : 4096;
+        while (new_cap < b -> len + sizeof(rec) + len)
+            new_cap *= 2;
+        char *tmp = realloc(b -> data, new_cap);
+        if (!tmp) { perror("realloc"); exit(1); }
+        stat_alloc();
+        b -> data = tmp;
+        b -> cap = new_cap;
+    }
+    memcpy(b -> data + b -> len, &rec, sizeof(rec));
+    if (len)
+        memcpy(b -> data + b -> len + sizeof(rec), text, len);
+    b -> len += sizeof(rec) + len;
+    wal_buffered = rec.lsn;
+    pthread_mutex_unlock(&wal_mutex);
+    return rec.lsn;
+}
+
+//waits until the record with this lsn is on disk (group commit)
+//the first mutator to get here writes and syncs every record appended so far, after waiting wal_window_us for more to arrive
+//mutators that get here while it does wait for its fdatasync, or the next one, rather than issuing one of their own
+static void wal_commit(uint64_t lsn) {
+    pthread_mutex_lock(&wal_mutex);
+    while (wal_durable < lsn) {
+        if (wal_syncing) {
+            pthread_cond_wait(&wal_synced, &wal_mutex);
+            continue;
+        }
+        wal_syncing = 1;
+        if (wal_window_us) {  //lets other mutators add their records to this batch
+            pthread_mutex_unlock(&wal_mutex);
+            usleep(wal_window_us);
+            pthread_mutex_lock(&wal_mutex);
+        }
+
+        //new records go into the spare buffer while this batch is written
+        WalBuffer batch = wal_pending;
+        uint64_t upto = wal_buffered;
+        wal_pending = wal_spare;
+        wal_pending.len = 0;
+        pthread_mutex_unlock(&wal_mutex);
+
+        for (size_t off = 0; off < batch.len; ) {
+            ssize_t n = write(wal_fd, batch.data + off, batch.len - off);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0) { perror("write-ahead log"); exit(1); }  //changes already made in memory can no longer be made durable
+            off += (size_t)n;
+        }
+        if (fdatasync(wal_fd) != 0) { perror("write-ahead log"); exit(1); }
+
+        pthread_mutex_lock(&wal_mutex);
+        wal_spare = batch;
+        wal_durable = upto;
+        wal_syncing = 0;
+        pthread_cond_broadcast(&wal_synced);
+    }
+    pthread_mutex_unlock(&wal_mutex);
+}
+
+//empties the write-ahead log once a snapshot holding every record in it (up to wal_lsn) is safely on disk
+//called with rules_lock held, so no record can be appended meanwhile - a crash before this just replays records the snapshot already has, and they are skipped
+static void wal_checkpoint(void) {
+    if (wal_fd < 0)
+        return;
+    pthread_mutex_lock(&wal_mutex);
+    while (wal_syncing)  //a commit may be writing records the snapshot already holds
+        pthread_cond_wait(&wal_synced, &wal_mutex);
+    if (ftruncate(wal_fd, 0) == 0 && fdatasync(wal_fd) == 0) {
+        wal_pending.len = 0;  //these are in the snapshot too
+        wal_durable = wal_lsn;
+        pthread_cond_broadcast(&wal_synced);
+    }
+    pthread_mutex_unlock(&wal_mutex);
+}
+
+static size_t queryset_home(const QuerySet *q, uint32_t ip, int port) {
+    uint64_t h = ((uint64_t)ip << 16 | (uint32_t)port) * 0x9E3779B97F4A7C15ull;
+    return (size_t)(h >> 32) & q -> mask;
+}
+
+//resizes the slot table to n slots and re-inserts every pair
+static void queryset_rehash(QuerySet *q, size_t n) {
+    arena_free(q -> slots);
+    q -> slots = arena_zalloc(n * sizeof(uint32_t));
+    q -> mask = n - 1;
+    for (size_t k = 0; k < q -> count; k++) {
+        size_t h = queryset_home(q, q -> pairs[k].ip, q -> pairs[k].port);
+        while (q -> slots[h])
+            h = (h + 1) & q -> mask;
+        q -> slots[h] = (uint32_t)(k + 1);
+    }
+}
+
+//counts one more hit for ip/port, adding the pair if it has not been seen before
+static void queryset_add(QuerySet *q, uint32_t ip, int port) {
+    size_t h = queryset_home(q, ip, port);
+    for (; q -> slots[h]; h = (h + 1) & q -> mask) {
+        PackedQuery *pq = &q -> pairs[q -> slots[h] - 1];
+        if (pq -> ip == ip && pq -> port == port) {
+            if (q -> hits[q -> slots[h] - 1] != UINT32_MAX)  //saturates rather than wrapping
+                q -> hits[q -> slots[h] - 1]++;
+            return;
+        }
+    }
+
+    if (q -> count == q -> cap) {
+        size_t new_cap = q -> cap * 2;
+        q -> pairs = arena_realloc(q -> pairs, q -> cap * sizeof(PackedQuery), new_cap * sizeof(PackedQuery));
+        q -> hits = arena_realloc(q -> hits, q -> cap * sizeof(uint32_t), new_cap * sizeof(uint32_t));
+        q -> cap = new_cap;
+    }
+    q -> pairs[q -> count] = (PackedQuery){ ip, (uint16_t)port };
+    q -> hits[q -> count] = 1;
+    q -> slots[h] = (uint32_t)(++q -> count);
+
+    if (q -> count * 4 > (q -> mask + 1) * 3)  //keep the table under 3/4 full
+        queryset_rehash(q, (q -> mask + 1) * 2);
+}
+
+//how many slots the table of a set holding count pairs has - it starts at 8 and doubles whenever it gets more than 3/4 full
+static size_t queryset_slots_for(size_t count) {
+    size_t n = 8;
+    while (count * 4 > n * 3)
+        n *= 2;
+    return n;
+}
+
+static QuerySet *queryset_new(void) {
+    QuerySet *q = arena_zalloc(sizeof(QuerySet));
+    q -> cap = 4;
+    q -> pairs = arena_alloc(q -> cap * sizeof(PackedQuery));
+    q -> hits = arena_alloc(q -> cap * sizeof(uint32_t));
+    queryset_rehash(q, 8);
+    return q;
+}
+
+static void history_free(QueryHistory *h) {
+    arena_free(h -> queries);
+    if (h -> distinct) {
+        arena_free(h -> distinct -> pairs);
+        arena_free(h -> distinct -> hits);
+        arena_free(h -> distinct -> slots);
+        arena_free(h -> distinct);
+    }
+    *h = (QueryHistory){0};
+}
+
+//adds ip/port to h, the history of the rule with this seq, which accepted it
+static void record_query(QueryHistory *h, uint64_t seq, uint32_t ip, int port) {
+    pthread_mutex_lock(query_lock_for(seq));  //other readers may be recording a match on the same rule
+    if (history_mode == QUERY_HISTORY_DISTINCT) {
+        if (!h -> distinct)
+            h -> distinct = queryset_new();
+        queryset_add(h -> distinct, ip, port);
+        pthread_mutex_unlock(query_lock_for(seq));
+        return;
+    }
+    //resize queries array to hold more Query structs, and store the result in tmp
+    if (h -> query_count == h -> query_cap) {
+        size_t new_cap;
+            if (h -> query_cap == 0) {
+                new_cap = 8;
+            } else {
+                new_cap = h -> query_cap * 2;
+            }
+        Query *tmp = arena_realloc(h -> queries, h -> query_count * sizeof(Query), new_cap * sizeof(Query));  //resize requests array to hold new_cap pointers, and store the result in tmp - a history loaded from a snapshot is copied out of it
+        h -> queries = tmp;  
+        h -> query_cap = new_cap;  
+    }
+    //writes the new Query struct into the empty slot in the queries array
+    h -> queries [h -> query_count].ip = ip;
+    h -> queries [h -> query_count].port = port;
+    h -> query_count++;
+    pthread_mutex_unlock(query_lock_for(seq));
+}
+
+//resizes every column of the rules table to hold cap rules
+static void table_grow(size_t cap) {
+    size_t n = rules.count;  //the columns of a loaded snapshot are mapped, so arena_realloc copies them out the first time they grow
+    rules.ip_start = arena_realloc(rules.ip_start, n * sizeof(uint32_t), cap * sizeof(uint32_t));
+    rules.ip_end = arena_realloc(rules.ip_end, n * sizeof(uint32_t), cap * sizeof(uint32_t));
+    rules.port_start = arena_realloc(rules.port_start, n * sizeof(int32_t), cap * sizeof(int32_t));
+    rules.port_end = arena_realloc(rules.port_end, n * sizeof(int32_t), cap * sizeof(int32_t));
+    rules.seq = arena_realloc(rules.seq, n * sizeof(uint64_t), cap * sizeof(uint64_t));
+    rules.history = arena_realloc(rules.history, n * sizeof(QueryHistory *), cap * sizeof(QueryHistory *));
+    rules.cap = cap;
+}
+
+static int rule_is_dead(size_t i) {
+    return rules.ip_start[i] > rules.ip_end[i];  //tombstones have an empty range
+}
+
+static void index_free(IndexNode *n) {
+    if (!n)
+        return;
+    index_free(n -> left);
+    index_free(n -> right);
+    arena_free(n);
+}
+
+static void prefix_free(PrefixNode *n) {
+    if (!n)
+        return;
+    for (unsigned k = 0; k < prefix_count(n -> list_bits); k++)
+        arena_free(n -> lists[k].entries);
+    for (unsigned k = 0; k < prefix_count(n -> child_bits); k++)
+        prefix_free(n -> children[k]);
+    arena_free(n -> lists);
+    arena_free(n -> children);
+    arena_free(n);
+}
+
+//empties every shard, handing its treap and trie back to the arena, so lookup_build can fill them again - called with every shard locked for writing
+static void shards_clear(void) {
+    for (unsigned s = 0; s < SHARD_COUNT; s++) {
+        index_free(shards[s].index);
+        prefix_free(shards[s].prefix);
+        shards[s].index = NULL;
+        shards[s].prefix = NULL;
+    }
+}
+
+//adds every live rule of the rules table to the shards in one go - the shards have to be empty, as after an F or a shards_clear
+//gives the same indexes lookup_add would build rule by rule, without the per-rule insertions: the index nodes are allocated together, radix sorted by (ip_start, seq)
+//and linked into each shard's treap in one sweep, and each shard's trie is laid out level by level by prefix_build
+static void lookup_build(void) {
+    size_t index_count = 0, cidr_count = 0;
+    for (size_t i = 0; i < rules.count; i++) {
+        if (rule_is_dead(i))
+            continue;
+        Rule r = { rules.ip_start[i], rules.ip_end[i], rules.port_start[i], rules.port_end[i] };
+        for (unsigned s = shard_of(r.ip_start); s <= shard_of(r.ip_end); s++) {
+            Rule piece = shard_piece(&r, s);
+            if (prefix_length(&piece) >= 0)
+                cidr_count++;
+            else
+                index_count++;
+        }
+    }
+
+    size_t scratch_size = 2 * index_count * sizeof(IndexNode *);  //room for a list and its sorted copy, of either kind
+    if (scratch_size < 2 * cidr_count * sizeof(PrefixPiece))
+        scratch_size = 2 * cidr_count * sizeof(PrefixPiece);
+    char *scratch = malloc(scratch_size ? scratch_size : 1);
+    if (!scratch) { perror("malloc"); exit(1); }
+    stat_alloc();
+
+    //index: nodes are made in table order, which is seq order, so a stable sort on ip_start leaves ties in seq order as index_less wants
+    IndexNode **nodes = (IndexNode **)scratch, **sorted = nodes + index_count;
+    arena_alloc_many(sizeof(IndexNode), index_count, (void **)nodes);
+    size_t k = 0;
+    for (size_t i = 0; i < rules.count; i++) {
+        if (rule_is_dead(i))
+            continue;
+        Rule r = { rules.ip_start[i], rules.ip_end[i], rules.port_start[i], rules.port_end[i] };
+        for (unsigned s = shard_of(r.ip_start); s <= shard_of(r.ip_end); s++) {
+            Rule piece = shard_piece(&r, s);
+            if (prefix_length(&piece) >= 0)
+                continue;
+            IndexNode *node = nodes[k++];
+            node -> ip_start = piece.ip_start;
+            node -> ip_end = piece.ip_end;
+            node -> port_start = (uint16_t)piece.port_start;
+            node -> port_end = (uint16_t)piece.port_end;
+            node -> seq = rules.seq[i];
+            node -> history = rules.history[i];
+            node -> left = node -> right = NULL;
+        }
+    }
+    for (int shift = 0; shift < 32; shift += 8) {  //least significant byte first, so after the last pass the order is by the whole ip_start
+        size_t start[257] = {0};
+        for (k = 0; k < index_count; k++)
+            start[(nodes[k] -> ip_start >> shift & 255) + 1]++;
+        for (int b = 0; b < 256; b++)
+            start[b + 1] += start[b];
+        for (k = 0; k < index_count; k++)
+            sorted[start[nodes[k] -> ip_start >> shift & 255]++] = nodes[k];
+        IndexNode **swap = nodes;
+        nodes = sorted;
+        sorted = swap;
+    }
+    for (k = 0; k < index_count; ) {  //sorted by ip_start means grouped by shard too
+        unsigned s = shard_of(nodes[k] -> ip_start);
+        size_t end = k;
+        while (end < index_count && shard_of(nodes[end] -> ip_start) == s)
+            end++;
+        shards[s].index = index_build(nodes + k, end - k, sorted);
+        k = end;
+    }
+
+    //tries: the pieces are grouped by shard with a counting sort, which keeps each shard's pieces in seq order
+    PrefixPiece *pieces = (PrefixPiece *)scratch, *by_shard = pieces + cidr_count;
+    size_t shard_start[SHARD_COUNT + 1] = {0};
+    k = 0;
+    for (size_t i = 0; i < rules.count; i++) {
+        if (rule_is_dead(i))
+            continue;
+        Rule r = { rules.ip_start[i], rules.ip_end[i], rules.port_start[i], rules.port_end[i] };
+        for (unsigned s = shard_of(r.ip_start); s <= shard_of(r.ip_end); s++) {
+            Rule piece = shard_piece(&r, s);
+            int len = prefix_length(&piece);
+            if (len < 0)
+                continue;
+            pieces[k++] = (PrefixPiece){ piece.ip_start, len, { rules.seq[i], rules.history[i], piece.port_start, piece.port_end } };
+            shard_start[s + 1]++;
+        }
+    }
+    for (unsigned s = 0; s < SHARD_COUNT; s++)
+        shard_start[s + 1] += shard_start[s];
+    size_t fill[SHARD_COUNT];
+    memcpy(fill, shard_start, sizeof(fill));
+    for (k = 0; k < cidr_count; k++)
+        by_shard[fill[shard_of(pieces[k].ip_start)]++] = pieces[k];
+    for (unsigned s = 0; s < SHARD_COUNT; s++) {
+        size_t count = shard_start[s + 1] - shard_start[s];
+        if (!count)
+            continue;
+        shards[s].prefix = prefix_node_new();
+        prefix_build(shards[s].prefix, 0, by_shard + shard_start[s], count, pieces + shard_start[s]);
+    }
+
+    for (unsigned s = 0; s < SHARD_COUNT; s++)
+        shards[s].generation++;
+    free(scratch);
+}
+
+#define HASH_EMPTY SIZE_MAX
+
+static uint64_t rule_hash_key(uint32_t ip_start, uint32_t ip_end, int32_t port_start, int32_t port_end) {
+    uint64_t h = ((uint64_t)ip_start << 32 | ip_end) * 0x9E3779B97F4A7C15ull;
+    h ^= ((uint64_t)(uint32_t)port_start << 16 | (uint32_t)port_end) * 0xC2B2AE3D27D4EB4Full;
+    h ^= h >> 31;  //mix the high bits back down, since the mask only keeps the low ones
+    h *= 0x94D049BB133111EBull;
+    return h ^ (h >> 29);
+}
+
+static size_t hash_home(size_t i) {
+    return rule_hash_key(rules.ip_start[i], rules.ip_end[i], rules.port_start[i], rules.port_end[i]) & rule_hash.mask;
+}
+
+static void hash_place(size_t i) {
+    size_t h = hash_home(i);
+    while (rule_hash.slots[h] != HASH_EMPTY)
+        h = (h + 1) & rule_hash.mask;
+    rule_hash.slots[h] = i;
+    rule_hash.used++;
+}
+
+//resizes the hash to fit cap rules at under half full and re-inserts every live rule
+static void hash_rebuild(size_t cap) {
+    size_t n = 16;
+    while (n < cap * 2)
+        n *= 2;
+    arena_free(rule_hash.slots);
+    rule_hash.slots = arena_alloc(n * sizeof(size_t));
+    memset(rule_hash.slots, 0xFF, n * sizeof(size_t));  //every byte 0xFF makes every slot HASH_EMPTY
+    rule_hash.mask = n - 1;
+    rule_hash.used = 0;
+
+    for (size_t i = 0; i < rules.count; i++)
+        if (!rule_is_dead(i))
+            hash_place(i);
+}
+
+static void hash_insert(size_t i) {
+    if ((rule_hash.used + 1) * 2 > rule_hash.mask + 1 || !rule_hash.slots)
+        hash_rebuild(rules.count);  //rule i is already in the table, so the rebuild inserts it
+    else
+        hash_place(i);
+}
+
+//returns the position of the earliest live rule with exactly the ranges in r, or HASH_EMPTY
+static size_t hash_find(const Rule *r) {
+    if (!rule_hash.slots)
+        return HASH_EMPTY;
+
+    size_t best = HASH_EMPTY;
+    size_t h = rule_hash_key(r -> ip_start, r -> ip_end, r -> port_start, r -> port_end) & rule_hash.mask;
+    for (; rule_hash.slots[h] != HASH_EMPTY; h = (h + 1) & rule_hash.mask) {  //identical rules all sit in the same run of slots
+        size_t i = rule_hash.slots[h];
+        if (i < best && rules.ip_start[i] == r -> ip_start && rules.ip_end[i] == r -> ip_end &&
+            rules.port_start[i] == r -> port_start && rules.port_end[i] == r -> port_end)
+            best = i;
+    }
+    return best;
+}
+
+//removes position i from the hash, shifting later entries of the run back so lookups never stop early at the hole
+static void hash_erase(size_t i) {
+    size_t h = hash_home(i);
+    while (rule_hash.slots[h] != i)
+        h = (h + 1) & rule_hash.mask;
+
+    size_t hole = h;
+    for (size_t j = (hole + 1) & rule_hash.mask; rule_hash.slots[j] != HASH_EMPTY; j = (j + 1) & rule_hash.mask) {
+        size_t home = hash_home(rule_hash.slots[j]);
+        //the entry at j can move into the hole only if its home slot is not between the hole and j (cyclically)
+        int movable = hole <= j ? (home <= hole || home > j) : (home <= hole && home > j);
+        if (movable) {
+            rule_hash.slots[hole] = rule_hash.slots[j];
+            hole = j;
+        }
+    }
+    rule_hash.slots[hole] = HASH_EMPTY;
+    rule_hash.used--;
+}
+
+//squeezes the tombstones out of every column, keeping the live rules in insertion order
+//positions change, so the hash is rebuilt - the shards and the query locks go by seq and history pointer and are unaffected
+static void table_compact(void) {
+    size_t out = 0;
+    for (size_t i = 0; i < rules.count; i++) {
+        if (rule_is_dead(i)) {
+            arena_free(rules.history[i]);  //emptied by table_remove, and no shard points at it any more
+            continue;
+        }
+        rules.ip_start[out] = rules.ip_start[i];
+        rules.ip_end[out] = rules.ip_end[i];
+        rules.port_start[out] = rules.port_start[i];
+        rules.port_end[out] = rules.port_end[i];
+        rules.seq[out] = rules.seq[i];
+        rules.history[out] = rules.history[i];
+        out++;
+    }
+    rules.count = out;
+    rules.dead = 0;
+    hash_rebuild(rules.count);
+}
+
+//turns the rule at position i into a tombstone - O(1), the space is reclaimed by a later table_compact
+static void table_remove(size_t i) {
+    history_free(rules.history[i]);
+    rules.ip_start[i] = 1;  //start after end: no ip or port can fall inside, so scans never match it
+    rules.ip_end[i] = 0;
+    rules.port_start[i] = 1;
+    rules.port_end[i] = 0;
+    rules.dead++;
+
+    if (rules.dead >= 32 && rules.dead * 2 >= rules.count)  //compacting only once half the table is dead keeps deletes O(1) amortized
+        table_compact();
+}
+
+//adds a parsed rule to the end of the rules table and to both indexes
+static void rule_add(const Rule *r) {
+    //allocate larger columns to hold more rules
+    if (rules.count == rules.cap) {
+        size_t new_cap;
+        if(rules.cap == 0) {
+            new_cap = 8;
+        } else {
+            new_cap = rules.cap * 2;
+        }
+        table_grow(new_cap);
+    }
+
+    //adds the new rule to the first empty slot in every column
+    size_t i = rules.count++;
+    rules.ip_start[i] = r -> ip_start;
+    rules.ip_end[i] = r -> ip_end;
+    rules.port_start[i] = r -> port_start;
+    rules.port_end[i] = r -> port_end;
+    rules.seq[i] = next_seq++;
+    rules.history[i] = arena_zalloc(sizeof(QueryHistory));
+    lookup_add(r, rules.seq[i], rules.history[i]);
+    hash_insert(i);
+}
+
+//the IPv6 rules: a table scanned in insertion order by a 128-bit comparison kernel, with histories kept the way QueryHistory keeps them
+//A and D change it under rules_lock for writing, and checks read it under rules_lock for reading, so it never touches the shards
+
+static size_t history6_home(const History6 *h, Ip6 ip, int port) {
+    uint64_t k = (ip.hi * 0x9E3779B97F4A7C15ull) ^ (ip.lo * 0xC2B2AE3D27D4EB4Full) ^ (uint64_t)(uint32_t)port;
+    k ^= k >> 31;
+    k *= 0x94D049BB133111EBull;
+    return (size_t)(k >> 32) & h -> mask;
+}
+
+//resizes the slot table of a QUERY_HISTORY_DISTINCT history to n slots and re-inserts every pair
+static void history6_rehash(History6 *h, size_t n) {
+    arena_free(h -> slots);
+    h -> slots = arena_zalloc(n * sizeof(uint32_t));
+    h -> mask = n - 1;
+    for (size_t k = 0; k < h -> count; k++) {
+        size_t at = history6_home(h, h -> queries[k].ip, h -> queries[k].port);
+        while (h -> slots[at])
+            at = (at + 1) & h -> mask;
+        h -> slots[at] = (uint32_t)(k + 1);
+    }
+}
+
+//appends ip/port to h with hits as its count (ignored unless distinct is set)
+static void history6_push(History6 *h, Ip6 ip, int port, uint32_t hits, int distinct) {
+    if (h -> count == h -> cap) {
+        size_t new_cap = h -> cap ? h -> cap * 2 : 8;
+        h -> queries = arena_realloc(h -> queries, h -> cap * sizeof(Query6), new_cap * sizeof(Query6));
+        if (distinct)
+            h -> hits = arena_realloc(h -> hits, h -> cap * sizeof(uint32_t), new_cap * sizeof(uint32_t));
+        h -> cap = new_cap;
+    }
+    h -> queries[h -> count] = (Query6){ ip, port };
+    if (!distinct) {
+        h -> count++;
+        return;
+    }
+    h -> hits[h -> count++] = hits;
+    if (!h -> slots || h -> count * 4 > (h -> mask + 1) * 3)  //keep the table under 3/4 full
+        history6_rehash(h, h -> slots ? (h -> mask + 1) * 2 : 16);
+    else {
+        size_t at = history6_home(h, ip, port);
+        while (h -> slots[at])
+            at = (at + 1) & h -> mask;
+        h -> slots[at] = (uint32_t)h -> count;
+    }
+}
+
+//adds ip/port to h, the history of the IPv6 rule with this seq, which accepted it
+static void record_query6(History6 *h, uint64_t seq, Ip6 ip, int port) {
+    pthread_mutex_lock(query_lock_for(seq));  //other checks may be recording a match on the same rule
+    if (history_mode == QUERY_HISTORY_DISTINCT && h -> slots) {
+        for (size_t at = history6_home(h, ip, port); h -> slots[at]; at = (at + 1) & h -> mask) {
+            size_t k = h -> slots[at] - 1;
+            if (h -> queries[k].ip.hi == ip.hi && h -> queries[k].ip.lo == ip.lo && h -> queries[k].port == port) {
+                if (h -> hits[k] != UINT32_MAX)  //saturates rather than wrapping
+                    h -> hits[k]++;
+                pthread_mutex_unlock(query_lock_for(seq));
+                return;
+            }
+        }
+    }
+    history6_push(h, ip, port, 1, history_mode == QUERY_HISTORY_DISTINCT);
+    pthread_mutex_unlock(query_lock_for(seq));
+}
+
+static void history6_free(History6 *h) {
+    arena_free(h -> queries);
+    arena_free(h -> hits);
+    arena_free(h -> slots);
+    arena_free(h);
+}
+
+//adds a rule with this seq to the end of the IPv6 table and returns its position
+static size_t rule6_append(const Rule6 *r, uint64_t seq) {
+    if (rules6.count == rules6.cap) {
+        size_t n = rules6.count, cap = rules6.cap ? rules6.cap * 2 : 8;
+        rules6.ip_start = arena_realloc(rules6.ip_start, n * sizeof(Ip6), cap * sizeof(Ip6));
+        rules6.ip_end = arena_realloc(rules6.ip_end, n * sizeof(Ip6), cap * sizeof(Ip6));
+        rules6.port_start = arena_realloc(rules6.port_start, n * sizeof(int32_t), cap * sizeof(int32_t));
+        rules6.port_end = arena_realloc(rules6.port_end, n * sizeof(int32_t), cap * sizeof(int32_t));
+        rules6.seq = arena_realloc(rules6.seq, n * sizeof(uint64_t), cap * sizeof(uint64_t));
+        rules6.history = arena_realloc(rules6.history, n * sizeof(History6 *), cap * sizeof(History6 *));
+        rules6.cap = cap;
+    }
+    size_t i = rules6.count++;
+    rules6.ip_start[i] = r -> ip_start;
+    rules6.ip_end[i] = r -> ip_end;
+    rules6.port_start[i] = r -> port_start;
+    rules6.port_end[i] = r -> port_end;
+    rules6.seq[i] = seq;
+    rules6.history[i] = arena_zalloc(sizeof(History6));
+    return i;
+}
+
+static void rule6_add(const Rule6 *r) {
+    rule6_append(r, next_seq++);
+}
+
+//deletes the earliest IPv6 rule with exactly the ranges in r - returns 0 if there is none
+static int rule6_delete(const Rule6 *r) {
+    size_t i = 0;
+    while (i < rules6.count && !(rules6.ip_start[i].hi == r -> ip_start.hi && rules6.ip_start[i].lo == r -> ip_start.lo &&
+                                 rules6.ip_end[i].hi == r -> ip_end.hi && rules6.ip_end[i].lo == r -> ip_end.lo &&
+                                 rules6.port_start[i] == r -> port_start && rules6.port_end[i] == r -> port_end))
+        i++;
+    if (i == rules6.count)
+        return 0;
+
+    history6_free(rules6.history[i]);
+    size_t after = rules6.count - i - 1;
+    memmove(&rules6.ip_start[i], &rules6.ip_start[i + 1], after * sizeof(Ip6));
+    memmove(&rules6.ip_end[i], &rules6.ip_end[i + 1], after * sizeof(Ip6));
+    memmove(&rules6.port_start[i], &rules6.port_start[i + 1], after * sizeof(int32_t));
+    memmove(&rules6.port_end[i], &rules6.port_end[i + 1], after * sizeof(int32_t));
+    memmove(&rules6.seq[i], &rules6.seq[i + 1], after * sizeof(uint64_t));
+    memmove(&rules6.history[i], &rules6.history[i + 1], after * sizeof(History6 *));
+    rules6.count--;
+    return 1;
+}
+
+//the 128-bit comparison kernel: returns the position of the first IPv6 rule (in insertion order) containing ip and port, or rules6.count if there is none
+//each bound is compared as one unsigned 128-bit number and the four tests are combined without branching, so the loop only branches once per rule
+static size_t scan_rules6(Ip6 ip, int port) {
+    unsigned __int128 v = (unsigned __int128)ip.hi << 64 | ip.lo;
+    for (size_t i = 0; i < rules6.count; i++) {
+        STAT_STEP();
+        unsigned __int128 start = (unsigned __int128)rules6.ip_start[i].hi << 64 | rules6.ip_start[i].lo;
+        unsigned __int128 end = (unsigned __int128)rules6.ip_end[i].hi << 64 | rules6.ip_end[i].lo;
+        if ((start <= v) & (v <= end) & (port >= rules6.port_start[i]) & (port <= rules6.port_end[i]))
+            return i;
+    }
+    return rules6.count;
+}
+
+//the rules table is kept in insertion order, so its seq column is sorted and can be binary searched
+static size_t find_rule6_by_seq(uint64_t seq) {
+    size_t lo = 0, hi = rules6.count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (rules6.seq[mid] < seq)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+//C for an IPv6 address - q has already been parsed by execute, which holds rules_lock for reading
+static const char *handle_C6(const Rule6 *q) {
+    stat_scan_begin();
+    size_t i = scan_rules6(q -> ip_start, q -> port_start);
+    stat_scan_end();
+    if (i == rules6.count)
+        return "Connection rejected";
+    record_query6(rules6.history[i], rules6.seq[i], q -> ip_start, q -> port_start);
+    return "Connection accepted";
+}
+
+//create rule
+static const char *handle_A(const char *request, size_t len, uint64_t *lsn) {
+    const char *rule_str = request + 2;  //rule_str is a pointer to the first element of the ip address part of the input string 
+
+    Rule r = {0};  //creates new Rule struct and initializes all fields to 0 (or pointers to NULL)
+    if (!parse_rule(rule_str, &r)) {  //calls parse rule on the rule_str string (starting at the element it points to - the start of the ip address)
+        Rule6 r6;
+        if (!parse_rule6(rule_str, &r6))
+            return "Invalid rule";
+        rule6_add(&r6);
+        *lsn = wal_append('a', NULL, request, len);
+        return "Rule added";
+    }
+
+    rule_add(&r);
+    *lsn = wal_append('A', &r, request, len);
+    return "Rule added";
+}
+
+// decision cache - each thread remembers which rule (if any) accepted the ip/port pairs it checked most recently, so repeat checks skip the shard search
+// an entry is tagged with the generation of the shard its ip falls in when it was made, and every A, D and F bumps the generations of the shards
+// it changes - so a stale entry is never matched, and invalidating costs the writer one increment per shard instead of a sweep of every thread's cache
+// the cache is direct-mapped: a pair that hashes to a taken slot simply replaces what was there
+// build with -DDECISION_CACHE_BITS=n to give each thread 2^n entries
+#ifndef DECISION_CACHE_BITS
+#define DECISION_CACHE_BITS 12
+#endif
+#define DECISION_CACHE_SIZE (1u << DECISION_CACHE_BITS)
+
+// DecisionEntry is one remembered check
+typedef struct {
+    uint64_t generation;  //of the ip's shard when the entry was made, 0 while the slot is empty
+    uint32_t ip;
+    int32_t port;
+    uint64_t seq;  //the rule that accepted the pair, or UINT64_MAX if none did
+    QueryHistory *history;  //that rule's history - only followed while the generation still matches, since a delete or F bumps it first
+} DecisionEntry;
+
+static __thread DecisionEntry *my_cache;
+static pthread_key_t cache_key;
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+
+static void cache_init(void) {
+    pthread_key_create(&cache_key, free);  //a thread's cache goes when it exits
+}
+
+//returns the calling thread's cache, making it on its first C
+static DecisionEntry *cache_mine(void) {
+    if (my_cache)
+        return my_cache;
+    pthread_once(&cache_once, cache_init);
+    my_cache = calloc(DECISION_CACHE_SIZE, sizeof(DecisionEntry));
+    if (!my_cache) { perror("calloc"); exit(1); }
+    stat_alloc();
+    pthread_setspecific(cache_key, my_cache);
+    return my_cache;
+}
+
+static size_t cache_slot(uint32_t ip, int port) {
+    uint64_t k = ((uint64_t)ip << 16 | (uint16_t)port) * 0x9E3779B97F4A7C15ull;
+    return (size_t)(k >> (64 - DECISION_CACHE_BITS));
+}
+
+//returns the seq of the first rule that accepts ip and port, recording the query against it, or 0 if no rule does (seqs start at 1)
+//only the shard ip falls in is searched, and only if this thread's decision cache has no current answer
+//the caller holds the shard's lock for reading, or rules_lock, which keeps every change out of the shards
+static uint64_t rule_check(uint32_t ip, int port) {
+    const Shard *s = &shards[shard_of(ip)];
+    DecisionEntry *e = &cache_mine()[cache_slot(ip, port)];
+    uint64_t best = UINT64_MAX;
+    QueryHistory *history = NULL;
+    if (e -> generation == s -> generation && e -> ip == ip && e -> port == port) {  //the generation can only move under the shard's write lock
+        stat_cache(1);
+        best = e -> seq;
+        history = e -> history;
+    } else {
+        stat_cache(0);
+        stat_scan_begin();
+        prefix_lookup(s -> prefix, ip, port, &best, &history);
+        index_lookup(s -> index, ip, port, &best, &history);  //seq of the first rule (in insertion order) that matches, or UINT64_MAX
+        stat_scan_end();
+        *e = (DecisionEntry){ s -> generation, ip, port, best, history };
+    }
+    if (best == UINT64_MAX)
+        return 0;
+    record_query(history, best, ip, port);
+    return best;
+}
+
+//C is used to check whether an ip address/port pair are both valid/well formed AND allowed according to the rules
+//execute parses it first, since the ip decides which shard to lock - q is NULL if it was malformed
+static const char *handle_C(const Rule *q) {
+    if (!q)
+        return "Illegal IP address or port specified";
+
+    if (rule_check(q -> ip_start, q -> port_start))
+        return "Connection accepted";
+
+    return "Connection rejected";
+}
+
+//frees all engine memory and resests the program back to a clean state
+//rules, histories, indexes and the log all live in the arena, so one arena_reset drops them however many there are
+static const char *handle_F(void) {
+    //F holds rules_lock and every shard lock for writing and every other user of the arena holds one of them, so nothing is allocating here
+    arena_reset();
+
+    //the pointers would be dangling, so the table and every shard are reset to zeroes/NULL
+    memset(&rules, 0, sizeof(rules));
+    memset(&rules6, 0, sizeof(rules6));
+    memset(&rule_hash, 0, sizeof(rule_hash));
+    for (unsigned s = 0; s < SHARD_COUNT; s++)
+        shards[s].index = NULL, shards[s].prefix = NULL, shards[s].generation++;  //the generations carry on, so no cached decision survives
+
+    log_init();  //start again from one empty chunk
+    log_generation++;  //any R still being listed has lost its entries
+
+    if (snapshot_map) {  //nothing points into the loaded snapshot any more
+        munmap(snapshot_map, snapshot_size);
+        snapshot_map = NULL;
+        snapshot_size = 0;
+    }
+
+    return "All rules deleted";
+}
+
+//deletes the earliest rule with exactly the ranges in r - returns 0 if there is none
+static int rule_delete(const Rule *r) {
+    size_t i = hash_find(r);
+    if (i == HASH_EMPTY)
+        return 0;
+
+    //removes it from both indexes, then frees its queries and leaves a tombstone in its place
+    lookup_remove(i);
+    hash_erase(i);
+    table_remove(i);
+    return 1;
+}
+
+//delete rule
+static const char *handle_D(const char *request, size_t len, uint64_t *lsn) {
+    const char *rule_str = request + 2;
+
+    Rule r = {0};  //creates a temporary Rule struct on the stack called r and initializes all fields to 0
+    if (!parse_rule(rule_str, &r)) { //parses rule_str and writes result at &r
+        Rule6 r6;
+        if (!parse_rule6(rule_str, &r6))
+            return "Invalid rule";
+        if (!rule6_delete(&r6))
+            return "Rule not found";
+        *lsn = wal_append('d', NULL, request, len);
+        return "Rule deleted";
+    }
+
+    if (!rule_delete(&r))
+        return "Rule not found";
+
+    *lsn = wal_append('D', &r, request, len);
+    return "Rule deleted";
+}  //temporary rule on stack deleted when the function returns
+
+//formats the "Rule: <ip> <port>" line for the rule at position i into l -> line - the same shape as an IPv6 rule's
+static void listing_rule_line(Listing *l, size_t i) {
+    char *p = l -> line;
+    memcpy(p, "Rule: ", 6);
+    p += 6;
+    p += format_ip(rules.ip_start[i], p);
+    if (rules.ip_start[i] != rules.ip_end[i]) {
+        *p++ = '-';
+        p += format_ip(rules.ip_end[i], p);
+    }
+
+    *p++ = ' ';
+    p += format_uint((uint32_t)rules.port_start[i], p);
+    if (rules.port_start[i] != rules.port_end[i]) {
+        *p++ = '-';
+        p += format_uint((uint32_t)rules.port_end[i], p);
+    }
+    *p++ = '\n';
+    l -> line_len = (size_t)(p - l -> line);
+    l -> line_off = 0;
+}
+
+//formats the "Query: ..." line for query j of history h into l -> line
+static void listing_query_line(Listing *l, const QueryHistory *h, size_t j) {
+    char *p = l -> line;
+    memcpy(p, "Query: ", 7);
+    p += 7;
+    if (h -> distinct) {  //each distinct pair once, followed by how many times it was accepted
+        p += format_ip(h -> distinct -> pairs[j].ip, p);
+        *p++ = ' ';
+        p += format_uint(h -> distinct -> pairs[j].port, p);
+        *p++ = ' ';
+        *p++ = 'x';
+        p += format_uint(h -> distinct -> hits[j], p);
+    } else {
+        p += format_ip(h -> queries[j].ip, p);
+        *p++ = ' ';
+        p += format_uint((uint32_t)h -> queries[j].port, p);
+    }
+    *p++ = '\n';
+    l -> line_len = (size_t)(p - l -> line);
+    l -> line_off = 0;
+}
+
+//formats the "Rule: <ip> <port>" line for the IPv6 rule at position j into l -> line
+static void listing_rule6_line(Listing *l, size_t j) {
+    char *p = l -> line;
+    memcpy(p, "Rule: ", 6);
+    p += 6;
+    p += format_ip6(rules6.ip_start[j], p);
+    if (rules6.ip_start[j].hi != rules6.ip_end[j].hi || rules6.ip_start[j].lo != rules6.ip_end[j].lo) {
+        *p++ = '-';
+        p += format_ip6(rules6.ip_end[j], p);
+    }
+
+    *p++ = ' ';
+    p += format_uint((uint32_t)rules6.port_start[j], p);
+    if (rules6.port_start[j] != rules6.port_end[j]) {
+        *p++ = '-';
+        p += format_uint((uint32_t)rules6.port_end[j], p);
+    }
+    *p++ = '\n';
+    l -> line_len = (size_t)(p - l -> line);
+    l -> line_off = 0;
+}
+
+//formats the "Query: ..." line for query k of the IPv6 history h into l -> line
+static void listing_query6_line(Listing *l, const History6 *h, size_t k) {
+    char *p = l -> line;
+    memcpy(p, "Query: ", 7);
+    p += 7;
+    p += format_ip6(h -> queries[k].ip, p);
+    *p++ = ' ';
+    p += format_uint((uint32_t)h -> queries[k].port, p);
+    if (h -> hits) {  //QUERY_HISTORY_DISTINCT
+        *p++ = ' ';
+        *p++ = 'x';
+        p += format_uint(h -> hits[k], p);
+    }
+    *p++ = '\n';
+    l -> line_len = (size_t)(p - l -> line);
+    l -> line_off = 0;
+}
+
+//copies as much of the pending line as fits into buf[n .. cap) and returns the new n
+static size_t listing_copy_line(Listing *l, char *buf, size_t n, size_t cap) {
+    size_t take = l -> line_len - l -> line_off;
+    if (take > cap - n)
+        take = cap - n;
+    memcpy(buf + n, l -> line + l -> line_off, take);
+    l -> line_off += take;
+    return n + take;
+}
+
+//lists every rule, and under each rule every query that matched it, carrying on from where the last piece stopped
+//IPv4 and IPv6 rules share one seq order, so the two tables are walked side by side and whichever rule came first is listed next
+//a rule's queries are listed as they stand when the listing reaches it, and rules deleted before then are skipped
+//returns the number of bytes written to buf
+static size_t listing_read_rules(Listing *l, char *buf, size_t cap) {
+    size_t n = listing_copy_line(l, buf, 0, cap);  //finish the line the last piece ran out of room for
+    size_t i = find_rule_by_seq(l -> seq);
+    size_t j = find_rule6_by_seq(l -> seq);
+    while (n < cap) {
+        if (i < rules.count && rule_is_dead(i)) {  //tombstones are not listed
+            i++;
+            continue;
+        }
+        uint64_t seq4 = i < rules.count ? rules.seq[i] : UINT64_MAX;
+        uint64_t seq6 = j < rules6.count ? rules6.seq[j] : UINT64_MAX;
+        int v6 = seq6 < seq4;
+        uint64_t seq = v6 ? seq6 : seq4;
+        if (seq >= l -> end_seq) {  //also true once both tables have run out
+            l -> done = 1;
+            break;
+        }
+        if (seq != l -> seq) {  //rule seq is finished or gone - start on the next one
+            l -> seq = seq;
+            l -> header_done = 0;
+            l -> query = 0;
+        }
+
+        if (!l -> header_done) {
+            if (v6)
+                listing_rule6_line(l, j);
+            else
+                listing_rule_line(l, i);
+            l -> header_done = 1;
+            n = listing_copy_line(l, buf, n, cap);
+            continue;
+        }
+
+        size_t count;
+        pthread_mutex_lock(query_lock_for(l -> seq));  //C checks can append queries (and move the array) while L runs
+        if (v6) {
+            History6 *h = rules6.history[j];
+            count = h -> count;
+            while (n < cap && l -> query < count) {
+                listing_query6_line(l, h, l -> query++);
+                n = listing_copy_line(l, buf, n, cap);
+            }
+        } else {
+            QueryHistory *h = rules.history[i];
+            count = h -> distinct ? h -> distinct -> count : h -> query_count;
+            while (n < cap && l -> query < count) {
+                listing_query_line(l, h, l -> query++);
+                n = listing_copy_line(l, buf, n, cap);
+            }
+        }
+        pthread_mutex_unlock(query_lock_for(l -> seq));
+
+        if (l -> query >= count) {  //every query of this rule is out - on to the next rule
+            l -> seq++;
+            l -> header_done = 0;
+            l -> query = 0;
+            if (v6)
+                j++;
+            else
+                i++;
+        }
+    }
+    return n;
+}
+
+//appends n bytes to the growing heap string *out, which holds *len bytes in *cap
+static void batch_append(char **out, size_t *len, size_t *cap, const char *s, size_t n) {
+    if (*cap - *len < n) {
+        size_t new_cap = *cap ? *cap * 2 : 4096;
+        while (new_cap - *len < n)
+            new_cap *= 2;
+        char *tmp = realloc(*out, new_cap);
+        if (!tmp) { perror("realloc"); exit(1); }
+        stat_alloc();
+        *out = tmp;
+        *cap = new_cap;
+    }
+    memcpy(*out + *len, s, n);
+    *len += n;
+}
+
+#ifndef NO_STATS
+static const char *const op_names[OP_COUNT] = { "C", "A", "D", "F", "L", "R", "S", "Illegal" };
+
+//adds up every thread's copy of the histogram at this offset in Stats
+static void histogram_merge(Histogram *total, size_t offset) {
+    memset(total, 0, sizeof(*total));
+    for (Stats *s = atomic_load(&stats_threads); s; s = s -> next) {
+        Histogram *h = (Histogram *)((char *)s + offset);
+        stat_add(&total -> count, atomic_load_explicit(&h -> count, memory_order_relaxed));
+        stat_add(&total -> sum, atomic_load_explicit(&h -> sum, memory_order_relaxed));
+        uint64_t max = atomic_load_explicit(&h -> max, memory_order_relaxed);
+        if (max > total -> max)
+            total -> max = max;
+        for (unsigned b = 0; b < STAT_BUCKETS; b++)
+            stat_add(&total -> buckets[b], atomic_load_explicit(&h -> buckets[b], memory_order_relaxed));
+    }
+}
+
+//the value at or below which a fraction q of the recorded values fall, to within a bucket
+static uint64_t histogram_percentile(const Histogram *h, double q) {
+    uint64_t count = h -> count, seen = 0;
+    uint64_t target = (uint64_t)(q * (double)count + 0.999999);
+    for (unsigned b = 0; b < STAT_BUCKETS; b++) {
+        seen += h -> buckets[b];
+        if (seen >= target && seen > 0) {
+            uint64_t top = stat_bucket_top(b);
+            return top < h -> max ? top : h -> max;
+        }
+    }
+    return h -> max;
+}
+
+//appends one formatted line to the report in *out, which holds *n bytes in *cap - a line is cut short at 255 bytes rather than overrunning
+static void stats_printf(char **out, size_t *n, size_t *cap, const char *fmt, ...) {
+    char line[256];
+    va_list args;
+    va_start(args, fmt);
+    int len = vsnprintf(line, sizeof(line), fmt, args);
+    va_end(args);
+    if (len < 0)
+        return;
+    batch_append(out, n, cap, line, (size_t)len < sizeof(line) ? (size_t)len : sizeof(line) - 1);
+}
+
+//appends one line summing up the histogram at this offset in Stats, with every value multiplied by scale
+static void stats_line(char **out, size_t *n, size_t *cap, const char *name, size_t offset, double scale, const char *unit) {
+    Histogram total;
+    histogram_merge(&total, offset);
+    unsigned long long count = total.count;
+    stats_printf(out, n, cap, "%s: count %llu mean %.0f%s p50 %.0f%s p90 %.0f%s p99 %.0f%s p99.9 %.0f%s max %.0f%s\n", name, count,
+        count ? (double)total.sum / (double)count * scale : 0.0, unit,
+        (double)histogram_percentile(&total, 0.5) * scale, unit, (double)histogram_percentile(&total, 0.9) * scale, unit,
+        (double)histogram_percentile(&total, 0.99) * scale, unit, (double)histogram_percentile(&total, 0.999) * scale, unit,
+        (double)total.max * scale, unit);
+}
+
+//adds up every thread's statistics into the text S hands out
+static void stats_report(Listing *l) {
+    char *out = NULL;
+    size_t cap = 0, n = 0;
+    pthread_once(&stats_once, stats_init);
+    uint64_t ticks = stat_now() - stats_start_ticks, ns = clock_ns() - stats_start_ns;
+    double ns_per_tick = ticks ? (double)ns / (double)ticks : 1.0;
+
+    for (int op = 0; op < OP_COUNT; op++) {
+        char name[32];
+        snprintf(name, sizeof(name), "Command %s", op_names[op]);
+        stats_line(&out, &n, &cap, name, offsetof(Stats, latency) + (size_t)op * sizeof(Histogram), ns_per_tick, "ns");
+    }
+    stats_line(&out, &n, &cap, "Lock wait read", offsetof(Stats, lock_wait), ns_per_tick, "ns");
+    stats_line(&out, &n, &cap, "Lock hold read", offsetof(Stats, lock_hold), ns_per_tick, "ns");
+    stats_line(&out, &n, &cap, "Lock wait write", offsetof(Stats, lock_wait) + sizeof(Histogram), ns_per_tick, "ns");
+    stats_line(&out, &n, &cap, "Lock hold write", offsetof(Stats, lock_hold) + sizeof(Histogram), ns_per_tick, "ns");
+    stats_line(&out, &n, &cap, "C scan length", offsetof(Stats, scan), 1.0, "");
+
+    unsigned long long allocs = 0, hits = 0, misses = 0;
+    for (Stats *s = atomic_load(&stats_threads); s; s = s -> next) {
+        allocs += atomic_load_explicit(&s -> allocs, memory_order_relaxed);
+        hits += atomic_load_explicit(&s -> cache_hits, memory_order_relaxed);
+        misses += atomic_load_explicit(&s -> cache_misses, memory_order_relaxed);
+    }
+    stats_printf(&out, &n, &cap, "Allocations: %llu\n", allocs);
+    stats_printf(&out, &n, &cap, "Decision cache: hits %llu misses %llu hit rate %.1f%% entries per thread %u\n", hits, misses,
+                 hits + misses ? 100.0 * (double)hits / (double)(hits + misses) : 0.0, DECISION_CACHE_SIZE);
+
+    l -> text = out;
+    l -> text_len = n;
+}
+#else
+static void stats_report(Listing *l) {
+    l -> text = make_response("Statistics not built in (compiled with NO_STATS)\n");
+    l -> text_len = strlen(l -> text);
+}
+#endif
+
+//copies out as much of the S report as fits in cap bytes - the report is put together on the first call, so it reflects the moment S is first read
+static size_t listing_read_stats(Listing *l, char *buf, size_t cap) {
+    if (!l -> text)
+        stats_report(l);
+    size_t n = l -> text_len - l -> text_off;
+    if (n > cap)
+        n = cap;
+    memcpy(buf, l -> text + l -> text_off, n);
+    l -> text_off += n;
+    if (l -> text_off == l -> text_len)
+        l -> done = 1;
+    return n;
+}
+
+//starts listing the output of an L or R - called with rules_lock held, and for R just after the R itself was logged at upto
+static Listing *listing_new(char kind, LogPos upto) {
+    Listing *l = calloc(1, sizeof(Listing));
+    if (!l) { perror("calloc"); exit(1); }
+    stat_alloc();
+    pthread_once(&format_once, format_init);
+    l -> kind = kind;
+    l -> end_seq = next_seq;
+    l -> generation = log_generation;
+    l -> pos = (LogPos){ log_head, 0 };
+    l -> upto = upto;
+    return l;
+}
+
+//reads the whole of a listing into one heap string and frees the listing - the string grows as it fills, so the output is only walked once
+static char *listing_drain(Listing *l) {
+    size_t cap = 4096, len = 0;
+    char *out = malloc(cap);
+    if (!out) { perror("malloc"); exit(1); }
+    stat_alloc();
+    for (;;) {
+        size_t n = readListing(l, out + len, cap - len - 1);  //-1 keeps room for the '\0'
+        len += n;
+        if (n == 0)
+            break;
+        if (cap - len - 1 == 0) {
+            char *tmp = realloc(out, cap * 2);
+            if (!tmp) { perror("realloc"); exit(1); }
+            stat_alloc();
+            out = tmp;
+            cap *= 2;
+        }
+    }
+    out[len] = '\0';
+    closeListing(l);
+    return out;
+}
+
+//chooses how accepted queries are recorded: QUERY_HISTORY_FULL (the default) keeps every query in order for L to print,
+//QUERY_HISTORY_DISTINCT keeps each distinct ip/port pair once with a hit count, so a rule's history stops growing with repeat traffic
+//the mode can only change while there are no rules (at startup or after F) - returns 1 on success and 0 otherwise
+int setQueryHistoryMode(int mode) {
+    if (mode != QUERY_HISTORY_FULL && mode != QUERY_HISTORY_DISTINCT)
+        return 0;
+    pthread_rwlock_wrlock(&rules_lock);
+    int ok = rules.count == rules.dead && rules6.count == 0;
+    if (ok)
+        history_mode = mode;
+    pthread_rwlock_unlock(&rules_lock);
+    return ok;
+}
+
+//works out which locks a request (a '\0'-terminated string) needs, without locking anything
+//A, D and F change the rules so they need rules_lock to themselves, along with the shards the rule falls in (every shard for F)
+//a well-formed C only reads the shard its ip falls in and locks nothing else - everything else only reads the rules table and shares rules_lock
+static void plan_request(const char *request, RequestPlan *p) {
+    p -> exclusive = 0;
+    p -> first = 1, p -> last = 0;
+    p -> shard = NULL;
+    p -> check_ok = p -> check6 = 0;
+    if (strncmp(request, "C ", 2) == 0) {
+        p -> check_ok = scan_args(request + 2, 0, &p -> args);  //a check takes a single ip and a single port, no ranges
+        if (p -> check_ok)
+            p -> shard = &shards[shard_of(p -> args.ip_start)];
+        else
+            p -> check6 = scan_args6(request + 2, 0, &p -> args6);
+    } else if (strncmp(request, "A ", 2) == 0 || strncmp(request, "D ", 2) == 0) {
+        p -> exclusive = 1;
+        if (parse_rule(request + 2, &p -> args))
+            p -> first = shard_of(p -> args.ip_start), p -> last = shard_of(p -> args.ip_end);
+    } else if (strcmp(request, "F") == 0) {
+        p -> exclusive = 1;
+        p -> first = 0, p -> last = SHARD_COUNT - 1;
+    }
+}
+
+//carries out a planned request - the caller holds the locks the plan asks for and has already logged it at log_pos
+//sets *lsn to the write-ahead log record of the change, if the request made one, and *op to what kind of request it was
+static const char *run_request(const char *request, size_t len, const RequestPlan *p, LogPos log_pos, Listing **listing, uint64_t *lsn, int *op) {
+    const char *response = "Illegal request";
+    *listing = NULL;
+    *lsn = 0;
+    *op = OP_ILLEGAL;
+
+    if (strcmp(request, "R" ) == 0)  //R takes no arguments - if statement returns 1/true if strings match (0 == 0)
+        response = NULL, *listing = listing_new('R', log_pos), *op = OP_R;
+    else if (strncmp(request, "A ", 2) == 0) //if statement returns true if first 2 characters of strings match (0 == 0)
+    /* strncmp(string1, string2, n): n = how many characters to check, starting from the beginning */
+        response = handle_A(request, len, lsn), *op = OP_A;
+    else if (strncmp(request, "C ", 2) == 0) //if statement returns true if first 2 characters of strings match (0 == 0)
+        response = p -> check6 ? handle_C6(&p -> args6) : handle_C(p -> check_ok ? &p -> args : NULL), *op = OP_C;
+    else if (strcmp(request, "F" ) == 0)  //F takes no arguments  - if statement returns 1/true if strings match (0 == 0)
+        response = handle_F(), *lsn = wal_append('F', NULL, request, len), *op = OP_F;
+    else if (strncmp(request, "D ", 2) == 0) //if statement returns true if first 2 characters of strings match (0 == 0)
+        response = handle_D(request, len, lsn), *op = OP_D;
+    else if (strcmp(request, "L" ) == 0)  //L takes no arguments  - if statement returns 1/true if strings match (0 == 0)
+        response = NULL, *listing = listing_new('L', log_pos), *op = OP_L;
+    else if (strcmp(request, "S") == 0)  //S takes no arguments and only reads the statistics
+        response = NULL, *listing = listing_new('S', log_pos), *op = OP_S;
+    return response;
+}
+
+//runs one request (a '\0'-terminated string of len characters) and returns its response
+//A, C, D and F only ever reply with a fixed message, which is returned as a static string
+//L and R return NULL and store a Listing of their output in *listing - it is read after rules_lock has been released
+static const char *execute(const char *request, size_t len, Listing **listing) {
+    RequestPlan plan;
+    plan_request(request, &plan);
+
+    uint64_t start = stat_now();
+    if (plan.shard)
+        pthread_rwlock_rdlock(&plan.shard -> lock);
+    else if (plan.exclusive)
+        lock_for_write(plan.first, plan.last);
+    else
+        pthread_rwlock_rdlock(&rules_lock);
+    uint64_t locked = stat_now();
+    LogPos log_pos = log_request(request, len);  //logged while a lock is held so F (which takes them all) can never clear the log under a reader
+
+    uint64_t lsn;  //write-ahead log record of the change, if the request made one
+    int op;
+    const char *response = run_request(request, len, &plan, log_pos, listing, &lsn, &op);
+
+    uint64_t unlocked = stat_now();
+    if (plan.shard)
+        pthread_rwlock_unlock(&plan.shard -> lock);
+    else if (plan.exclusive)
+        unlock_for_write(plan.first, plan.last);
+    else
+        pthread_rwlock_unlock(&rules_lock);
+    stat_lock(plan.exclusive, locked - start, unlocked - locked);
+    if (lsn) {
+        wal_commit(lsn);  //the reply is only sent once the change is durable, but other requests can run while it syncs
+        unlocked = stat_now();  //the wait for the disk counts towards the request's time
+    }
+    if (*listing)
+        (*listing) -> busy = unlocked - start;  //the rest is added as the output is read, and recorded when the listing is closed
+    else
+        stat_request(op, unlocked - start);  //nothing after the unlock takes long enough to be worth another clock read
+    return response;
+}
+
+//runs a request that does not need to be '\0'-terminated and is not modified, copying it so execute can treat it as a string
+static const char *execute_copy(const char *request, size_t len, Listing **listing) {
+    len = strnlen(request, len);  //stop at an embedded '\0' the same way processRequest would
+
+    char local[256];  //every well-formed request fits here, so the copy normally stays on the stack
+    char *copy = local;
+    if (len >= sizeof(local)) {
+        copy = malloc(len + 1);
+        if (!copy) { perror("malloc"); exit(1); }
+        stat_alloc();
+    }
+    memcpy(copy, request, len);
+    copy[len] = '\0';
+
+    const char *response = execute(copy, len, listing);
+    if (copy != local)
+        free(copy);
+    return response;
+}
+
+//allocation-free version of processRequest: request does not need to be '\0'-terminated and is not modified
+//fixed replies are returned as static strings and buf is left alone; L and R are written straight into buf and buf is returned
+//returns NULL if the L or R output (plus its '\0') does not fit in cap bytes - the request has still been carried out
+const char *processRequestInto(const char *request, size_t len, char *buf, size_t cap) {
+    Listing *l;
+    const char *response = execute_copy(request, len, &l);
+    if (!l)
+        return response;
+
+    response = NULL;
+    if (cap > 0) {
+        size_t n = 0, got;
+        while (n < cap - 1 && (got = readListing(l, buf + n, cap - 1 - n)) > 0)
+            n += got;
+        char spare;
+        if (readListing(l, &spare, 1) == 0) {  //nothing left over, so the whole output fitted
+            buf[n] = '\0';
+            response = buf;
+        }
+    }
+    closeListing(l);
+    return response;
+}
+
+//starts an L, R or S whose output is then read a piece at a time with readListing, so it never has to be held in memory all at once
+//the request is logged and ordered against other requests exactly as processRequest would do it
+//returns NULL, without running anything, if request is not L, R or S
+Listing *openListing(const char *request, size_t len) {
+    len = strnlen(request, len);
+    if (len != 1 || (request[0] != 'L' && request[0] != 'R' && request[0] != 'S'))
+        return NULL;
+    Listing *l;
+    execute_copy(request, len, &l);
+    return l;
+}
+
+//writes the next piece of a listing's output (at most cap bytes, cap > 0) into buf and returns its length, or 0 once the output is finished
+//rules_lock is only held for one piece at a time, so A, D and F are never held up by a long listing for longer than it takes to fill buf
+//an L that runs alongside other requests sees each rule as it stands when the listing reaches it, and an R stops early if an F clears the log
+size_t readListing(Listing *l, char *buf, size_t cap) {
+    if (l -> done)
+        return 0;
+    uint64_t start = stat_now();
+    if (l -> kind == 'S') {  //the statistics are not guarded by rules_lock
+        size_t n = listing_read_stats(l, buf, cap);
+        l -> busy += stat_now() - start;
+        return n;
+    }
+    pthread_rwlock_rdlock(&rules_lock);
+    uint64_t locked = stat_now();
+    size_t n = l -> kind == 'L' ? listing_read_rules(l, buf, cap) : listing_read_log(l, buf, cap);
+    uint64_t unlocked = stat_now();
+    pthread_rwlock_unlock(&rules_lock);
+    stat_lock(0, locked - start, unlocked - locked);
+    l -> busy += unlocked - start;
+    return n;
+}
+
+void closeListing(Listing *l) {
+    stat_request(l -> kind == 'L' ? OP_L : l -> kind == 'R' ? OP_R : OP_S, l -> busy);
+    free(l -> text);
+    free(l);
+}
+
+//runs every request in requests[0 .. len), one per line, and returns all of their responses in one heap string, each followed by '\n' - *out_len is set to its length
+//lines end in '\n' or "\r\n" and a last line with neither still counts, just as ruleServer reads them
+//the result is what running the lines one after another would give, down to the order R sees them logged in, but the locking is done once per run:
+//consecutive requests that only read (C, L, R, S and illegal ones) share one hold of rules_lock for reading, and consecutive A, D and F share
+//one hold of rules_lock for writing along with every shard any of them touches - an A, D or F run is also made durable with a single wal_commit
+//L and R are read out in full before the next request runs, so they see the rules exactly as they would on their own
+char *processBatch(const char *requests, size_t len, size_t *out_len) {
+    char *text = malloc(len + 1);  //a copy the lines can be cut up in
+    if (!text) { perror("malloc"); exit(1); }
+    stat_alloc();
+    memcpy(text, requests, len);
+    text[len] = '\0';
+
+    size_t count = 0;
+    for (size_t k = 0; k < len; k++)
+        count += text[k] == '\n';
+    if (len > 0 && text[len - 1] != '\n')
+        count++;
+    char **lines = malloc((count ? count : 1) * sizeof(char *));
+    size_t *lens = malloc((count ? count : 1) * sizeof(size_t));
+    RequestPlan *plans = malloc((count ? count : 1) * sizeof(RequestPlan));
+    if (!lines || !lens || !plans) { perror("malloc"); exit(1); }
+    stat_alloc();
+
+    //the requests are cut into '\0'-terminated lines and planned before anything is locked
+    char *p = text;
+    for (size_t k = 0; k < count; k++) {
+        char *nl = memchr(p, '\n', (size_t)(text + len - p));
+        char *end = nl ? nl : text + len;
+        if (end > p && end[-1] == '\r')  //accept "\r\n" line endings, as ruleServer does
+            end--;
+        *end = '\0';
+        lines[k] = p;
+        lens[k] = strlen(p);  //stops at an embedded '\0' the same way processRequest would
+        plan_request(p, &plans[k]);
+        p = nl ? nl + 1 : text + len;
+    }
+
+    pthread_once(&log_once, log_init);
+    char *out = NULL;
+    size_t out_n = 0, out_cap = 0;
+    for (size_t k = 0; k < count; ) {
+        //the run is every request from k on that locks the same way - writers lock the span of shards their rules fall in
+        int exclusive = plans[k].exclusive;
+        unsigned first = SHARD_COUNT, last = 0;
+        size_t end = k;
+        for (; end < count && plans[end].exclusive == exclusive; end++) {
+            if (plans[end].first > plans[end].last)
+                continue;
+            if (plans[end].first < first)
+                first = plans[end].first;
+            if (plans[end].last > last)
+                last = plans[end].last;
+        }
+
+        uint64_t start = stat_now();
+        if (exclusive)
+            lock_for_write(first, last);
+        else
+            pthread_rwlock_rdlock(&rules_lock);  //keeps every writer out, so a C can skip its shard lock
+        uint64_t locked = stat_now(), last_lsn = 0, done = start;
+        for (; k < end; k++) {
+            LogPos log_pos = log_request(lines[k], lens[k]);
+            Listing *l;
+            uint64_t lsn;
+            int op;
+            const char *response = run_request(lines[k], lens[k], &plans[k], log_pos, &l, &lsn, &op);
+            if (l) {
+                //read with the lock this run already holds - readListing would take rules_lock again
+                char chunk[4096];
+                size_t n;
+                while (!l -> done && (n = l -> kind == 'S' ? listing_read_stats(l, chunk, sizeof(chunk)) :
+                                          l -> kind == 'L' ? listing_read_rules(l, chunk, sizeof(chunk)) :
+                                          listing_read_log(l, chunk, sizeof(chunk))) > 0)
+                    batch_append(&out, &out_n, &out_cap, chunk, n);
+            } else {
+                batch_append(&out, &out_n, &out_cap, response, strlen(response));
+            }
+            batch_append(&out, &out_n, &out_cap, "\n", 1);
+            if (lsn)
+                last_lsn = lsn;
+
+            uint64_t now = stat_now();  //each request is timed from where the one before it finished - the first also waited for the lock
+            if (l) {
+                l -> busy = now - done;
+                closeListing(l);
+            } else {
+                stat_request(op, now - done);
+            }
+            done = now;
+        }
+        uint64_t unlocked = stat_now();
+        if (exclusive)
+            unlock_for_write(first, last);
+        else
+            pthread_rwlock_unlock(&rules_lock);
+        stat_lock(exclusive, locked - start, unlocked - locked);
+        if (last_lsn)
+            wal_commit(last_lsn);  //records are synced in order, so the run's last one covers all of them
+    }
+
+    free(text);
+    free(lines);
+    free(lens);
+    free(plans);
+    batch_append(&out, &out_n, &out_cap, "", 1);  //a '\0' after the responses, not counted in *out_len
+    *out_len = out_n - 1;
+    return out;
+}
+
+char *processRequest(char *request) {
+
+    //trim trailing whitespace characters
+    size_t len = strlen(request);
+    while(len > 0 && isspace((unsigned char)request[len - 1])) //while request is non-empty and last character is whitespace/trailing character - keep going
+    //isspace returns true for any whitespace character: space ' ', tab '\t', newline '\n', carriage return '\r', vertical tab '\v', and form feed '\f'
+        request[--len] = '\0'; //overwrite any whitespace characters at the end of request string with '\0'
+
+    Listing *l;
+    const char *response = execute(request, len, &l);
+    if (l)
+        return listing_drain(l);  //L and R are read out into one heap string
+    return make_response(response);  //callers of processRequest free the response, so fixed replies are copied to the heap
+}
+
+//returns the position of the first rule from position i onwards that contains ip and port, or rules.count if there is none
+static size_t scan_columns_scalar(size_t i, uint32_t ip, int32_t port) {
+    for (; i < rules.count; i++)
+        if (ip >= rules.ip_start[i] && ip <= rules.ip_end[i] &&
+            port >= rules.port_start[i] && port <= rules.port_end[i])
+            break;
+    return i;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+//unsigned a <= b is tested as max(a, b) == b, since SSE/AVX2 only have signed greater-than compares
+__attribute__((target("avx2")))
+static size_t scan_columns_avx2(uint32_t ip, int32_t port) {
+    __m256i vip = _mm256_set1_epi32((int)ip);
+    __m256i vport = _mm256_set1_epi32(port);
+    size_t i = 0;
+    for (; i + 8 <= rules.count; i += 8) {  //8 rules per step
+        __m256i s = _mm256_loadu_si256((const __m256i *)&rules.ip_start[i]);
+        __m256i e = _mm256_loadu_si256((const __m256i *)&rules.ip_end[i]);
+        __m256i ps = _mm256_loadu_si256((const __m256i *)&rules.port_start[i]);
+        __m256i pe = _mm256_loadu_si256((const __m256i *)&rules.port_end[i]);
+        __m256i m = _mm256_and_si256(
+            _mm256_and_si256(_mm256_cmpeq_epi32(_mm256_max_epu32(s, vip), vip),
+                             _mm256_cmpeq_epi32(_mm256_min_epu32(e, vip), vip)),
+            _mm256_and_si256(_mm256_cmpeq_epi32(_mm256_max_epi32(ps, vport), vport),
+                             _mm256_cmpeq_epi32(_mm256_min_epi32(pe, vport), vport)));
+        int bits = _mm256_movemask_ps(_mm256_castsi256_ps(m));  //one bit per rule that matched
+        if (bits)
+            return i + (size_t)__builtin_ctz((unsigned)bits);  //lowest bit is the earliest rule
+    }
+    return scan_columns_scalar(i, ip, port);
+}
+
+__attribute__((target("sse4.1")))
+static size_t scan_columns_sse41(uint32_t ip, int32_t port) {
+    __m128i vip = _mm_set1_epi32((int)ip);
+    __m128i vport = _mm_set1_epi32(port);
+    size_t i = 0;
+    for (; i + 4 <= rules.count; i += 4) {  //4 rules per step
+        __m128i s = _mm_loadu_si128((const __m128i *)&rules.ip_start[i]);
+        __m128i e = _mm_loadu_si128((const __m128i *)&rules.ip_end[i]);
+        __m128i ps = _mm_loadu_si128((const __m128i *)&rules.port_start[i]);
+        __m128i pe = _mm_loadu_si128((const __m128i *)&rules.port_end[i]);
+        __m128i m = _mm_and_si128(
+            _mm_and_si128(_mm_cmpeq_epi32(_mm_max_epu32(s, vip), vip),
+                          _mm_cmpeq_epi32(_mm_min_epu32(e, vip), vip)),
+            _mm_and_si128(_mm_cmpeq_epi32(_mm_max_epi32(ps, vport), vport),
+                          _mm_cmpeq_epi32(_mm_min_epi32(pe, vport), vport)));
+        int bits = _mm_movemask_ps(_mm_castsi128_ps(m));
+        if (bits)
+            return i + (size_t)__builtin_ctz((unsigned)bits);
+    }
+    return scan_columns_scalar(i, ip, port);
+}
+#endif
+
+static size_t scan_columns_plain(uint32_t ip, int32_t port) {
+    return scan_columns_scalar(0, ip, port);
+}
+
+static size_t (*scan_columns)(uint32_t ip, int32_t port) = scan_columns_plain;  //best version this cpu supports, picked once by scan_columns_pick
+static pthread_once_t scan_columns_once = PTHREAD_ONCE_INIT;
+
+static void scan_columns_pick(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        scan_columns = scan_columns_avx2;
+    else if (__builtin_cpu_supports("sse4.1"))
+        scan_columns = scan_columns_sse41;
+#endif
+}
+
+#define BATCH_SCAN_MAX 512  //up to this many rules the vector scan beats a walk down the index - past it, checkBatch goes through rule_check like C does
+
+//checks n ip/port pairs at once - the same as sending n C requests, without the text parsing or the request log
+//accepted[k] is set to 1 or 0, and rule_seq[k] (if rule_seq is not NULL) to the seq of the matching rule, or 0 - seqs stay the same however many rules are deleted
+//matches are recorded in the rule's queries exactly as C records them, and S counts each pair as a C
+//pairs are IPv4 only - IPv6 rules are never matched here
+void checkBatch(const uint32_t *ips, const uint16_t *ports, size_t n, uint8_t *accepted, uint64_t *rule_seq) {
+    pthread_once(&scan_columns_once, scan_columns_pick);
+
+    uint64_t start = stat_now();
+    pthread_rwlock_rdlock(&rules_lock);
+    uint64_t locked = stat_now(), done = start;  //each pair is timed from where the one before it finished, the first from the lock request
+    int scan = rules.count <= BATCH_SCAN_MAX;
+    for (size_t k = 0; k < n; k++) {
+        uint64_t seq = 0;
+        if (scan) {
+            size_t i = scan_columns(ips[k], ports[k]);
+            stat_scan(i < rules.count ? i + 1 : rules.count);
+            if (i < rules.count) {
+                seq = rules.seq[i];
+                record_query(rules.history[i], seq, ips[k], ports[k]);
+            }
+        } else {
+            seq = rule_check(ips[k], ports[k]);
+        }
+        accepted[k] = seq != 0;
+        if (rule_seq)
+            rule_seq[k] = seq;
+        uint64_t now = stat_now();
+        stat_request(OP_C, now - done);
+        done = now;
+    }
+    uint64_t unlocked = stat_now();
+    pthread_rwlock_unlock(&rules_lock);
+    stat_lock(0, locked - start, unlocked - locked);
+}
+
+// binary wire protocol - a fixed-layout alternative to the text C, A and D requests that skips the text parsing altogether
+// every frame starts with a 1-byte opcode, and all numbers are big-endian:
+//  BIN_CHECK:  opcode, ip (4 bytes), port (2 bytes)
+//  BIN_ADD:    opcode, ip_start (4), ip_end (4), port_start (2), port_end (2)
+//  BIN_DELETE: the same layout as BIN_ADD
+// a single ip or port is sent as a range that starts and ends on it
+// the reply is one status byte (BIN_STATUS_*)
+// the opcodes are control characters that never start a text request, so a front-end can take both kinds of request on one connection
+// binary requests run on the same rules as text ones, and are written to the request log in the text form of the same request (such as "A 1.2.3.4 80"), so R lists them among the text ones
+#define BIN_CHECK 0x01
+#define BIN_ADD 0x02
+#define BIN_DELETE 0x03
+
+#define BIN_STATUS_ACCEPTED 0x00  //"Connection accepted"
+#define BIN_STATUS_REJECTED 0x01  //"Connection rejected"
+#define BIN_STATUS_ADDED 0x02  //"Rule added"
+#define BIN_STATUS_DELETED 0x03  //"Rule deleted"
+#define BIN_STATUS_NOT_FOUND 0x04  //"Rule not found"
+#define BIN_STATUS_INVALID_RULE 0x05  //"Invalid rule" - a range that goes downwards
+#define BIN_STATUS_ILLEGAL 0x06  //"Illegal request" - not a binary opcode
+
+static uint32_t read_be32(const uint8_t *p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static uint16_t read_be16(const uint8_t *p) {
+    return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+//returns how many bytes (opcode included) the frame starting with opcode takes, or 0 if opcode is not a binary opcode
+size_t binaryFrameLength(uint8_t opcode) {
+    switch (opcode) {
+        case BIN_CHECK: return 7;
+        case BIN_ADD:
+        case BIN_DELETE: return 13;
+        default: return 0;
+    }
+}
+
+#define BIN_TEXT_MAX 64  //longest text form of a binary request, "A 255.255.255.255-255.255.255.255 65535-65535" and its '\0' included
+
+//writes the text form of a binary C, A or D request to out (BIN_TEXT_MAX bytes) and returns its length - a single ip or port is written without a range
+static size_t binary_text(const uint8_t *frame, char *out) {
+    pthread_once(&format_once, format_init);
+    char *p = out;
+    *p++ = frame[0] == BIN_CHECK ? 'C' : frame[0] == BIN_ADD ? 'A' : 'D';
+    *p++ = ' ';
+    uint32_t ip_start = read_be32(frame + 1);
+    p += format_ip(ip_start, p);
+    if (frame[0] == BIN_CHECK) {
+        *p++ = ' ';
+        p += format_uint(read_be16(frame + 5), p);
+        return (size_t)(p - out);
+    }
+
+    uint32_t ip_end = read_be32(frame + 5);
+    uint16_t port_start = read_be16(frame + 9), port_end = read_be16(frame + 11);
+    if (ip_end != ip_start) {
+        *p++ = '-';
+        p += format_ip(ip_end, p);
+    }
+    *p++ = ' ';
+    p += format_uint(port_start, p);
+    if (port_end != port_start) {
+        *p++ = '-';
+        p += format_uint(port_end, p);
+    }
+    return (size_t)(p - out);
+}
+
+//runs one binary request - frame holds binaryFrameLength(frame[0]) bytes - and returns its status byte
+//C, A and D are logged as their text form while the lock is held, the same way execute logs text requests - an unknown opcode is not logged
+//counted by S under the same commands as their text forms
+uint8_t processBinary(const uint8_t *frame) {
+    uint8_t op = frame[0];
+    char text[BIN_TEXT_MAX];
+    uint64_t start = stat_now();
+    if (op == BIN_CHECK) {
+        uint32_t ip = read_be32(frame + 1);
+        size_t len = binary_text(frame, text);
+        Shard *s = &shards[shard_of(ip)];
+        pthread_rwlock_rdlock(&s -> lock);
+        uint64_t locked = stat_now();
+        log_request(text, len);
+        int accepted = rule_check(ip, read_be16(frame + 5)) != 0;
+        uint64_t unlocked = stat_now();
+        pthread_rwlock_unlock(&s -> lock);
+        stat_lock(0, locked - start, unlocked - locked);
+        stat_request(OP_C, unlocked - start);
+        return accepted ? BIN_STATUS_ACCEPTED : BIN_STATUS_REJECTED;
+    }
+    if (op != BIN_ADD && op != BIN_DELETE) {
+        stat_request(OP_ILLEGAL, stat_now() - start);
+        return BIN_STATUS_ILLEGAL;
+    }
+
+    size_t len = binary_text(frame, text);
+    Rule r = { read_be32(frame + 1), read_be32(frame + 5), read_be16(frame + 9), read_be16(frame + 11) };
+    if (r.ip_start > r.ip_end || r.port_start > r.port_end) {  //the text form rejects these too
+        pthread_rwlock_rdlock(&rules_lock);
+        log_request(text, len);
+        pthread_rwlock_unlock(&rules_lock);
+        stat_request(op == BIN_ADD ? OP_A : OP_D, stat_now() - start);
+        return BIN_STATUS_INVALID_RULE;
+    }
+
+    lock_for_write(shard_of(r.ip_start), shard_of(r.ip_end));
+    uint64_t locked = stat_now();
+    log_request(text, len);
+    uint8_t status;
+    uint64_t lsn = 0;
+    if (op == BIN_ADD) {
+        rule_add(&r);
+        lsn = wal_append('A', &r, text, len);
+        status = BIN_STATUS_ADDED;
+    } else if (rule_delete(&r)) {
+        lsn = wal_append('D', &r, text, len);
+        status = BIN_STATUS_DELETED;
+    } else {
+        status = BIN_STATUS_NOT_FOUND;
+    }
+    uint64_t unlocked = stat_now();
+    unlock_for_write(shard_of(r.ip_start), shard_of(r.ip_end));
+    stat_lock(1, locked - start, unlocked - locked);
+    if (lsn) {
+        wal_commit(lsn);
+        unlocked = stat_now();
+    }
+    stat_request(op == BIN_ADD ? OP_A : OP_D, unlocked - start);
+    return status;
+}
+
+// snapshot file - every rule, every recorded query and the request log, laid out so that loadSnapshot can map the file and use it in place
+// numbers are in the byte order of the machine that wrote the file, which is the only kind of machine that can load it
+// the header is followed by these sections, each starting on an 8-byte boundary at the offset the header gives:
+//  ip_start, ip_end, port_start, port_end, seq - the RuleTable columns, tombstones included, used in place as the columns
+//  histories - each rule's QueryHistory, used in place as the history column - its pointers hold offsets from the start of the file (0 for NULL), which loadSnapshot turns into addresses
+//  queries - QUERY_HISTORY_FULL only: Query entries, rule after rule, used in place as each rule's queries array
+//  sets - QUERY_HISTORY_DISTINCT only: the QuerySet of every rule that has one, used in place with its pointers stored as offsets like the histories
+//  pairs, hits, slots - QUERY_HISTORY_DISTINCT only: each set's pairs, hit counts and slot table, set after set
+//  rules6, queries6, hits6 - the IPv6 rules as Rule6Image entries, then their queries and (QUERY_HISTORY_DISTINCT only) hits, which loadSnapshot copies out
+//  log - a LogChunk (header and data) holding every logged request, used in place as the first chunk of the log
+#define SNAPSHOT_MAGIC "RULESNAP"
+#define SNAPSHOT_VERSION 3
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t history_mode;
+    uint64_t file_size;
+    uint64_t rule_count, dead, next_seq;
+    uint64_t query_count;  //entries in queries, or in pairs and hits
+    uint64_t set_count, slot_count;  //entries in sets and in slots
+    uint64_t log_size;  //bytes of log data, not counting the LogChunk header
+    uint64_t wal_lsn;  //lsn of the last write-ahead log record the snapshot holds - openWal only replays records after it
+    uint64_t ip_start, ip_end, port_start, port_end, seq, histories, queries, sets, pairs, hits, slots, log;  //section offsets
+    uint64_t rule6_count, query6_count;
+    uint64_t rules6, queries6, hits6;  //IPv6 section offsets
+} SnapshotHeader;
+
+// Rule6Image is one IPv6 rule in the rules6 section - its query_count queries follow those of the rule before it in queries6
+typedef struct {
+    Ip6 ip_start, ip_end;
+    int32_t port_start, port_end;
+    uint64_t seq, query_count;
+} Rule6Image;
+
+//pads the n bytes just written with zeroes up to the next multiple of 8, adding both to *offset
+static int snapshot_pad(FILE *f, uint64_t n, uint64_t *offset) {
+    static const char zeroes[8];
+    size_t pad = (size_t)((8 - n % 8) % 8);
+    if (pad && fwrite(zeroes, 1, pad, f) != pad)
+        return 0;
+    *offset += n + pad;
+    return 1;
+}
+
+//writes n bytes and pads with zeroes up to the next multiple of 8, adding both to *offset
+static int snapshot_write(FILE *f, const void *data, size_t n, uint64_t *offset) {
+    if (n && fwrite(data, 1, n, f) != n)
+        return 0;
+    return snapshot_pad(f, n, offset);
+}
+
+//returns how many bytes of chunk c hold finished entries, stopping at the entry that starts at end_offset if c is end_chunk
+static size_t snapshot_log_extent(LogChunk *c, LogChunk *end_chunk, size_t end_offset) {
+    size_t used = atomic_load(&c -> used);
+    size_t limit = c == end_chunk ? end_offset : (used < c -> size ? used : c -> size);
+    size_t off = 0;
+    while (off + sizeof(uint32_t) <= limit) {
+        uint32_t h = log_wait(c, off);
+        if (h == LOG_END)
+            break;
+        off += (sizeof(uint32_t) + (h - 1) + 3) & ~(size_t)3;
+    }
+    return off;
+}
+
+//writes everything a snapshot holds to f - called with rules_lock held for reading
+static int snapshot_write_all(FILE *f) {
+    SnapshotHeader hd = {0};
+    memcpy(hd.magic, SNAPSHOT_MAGIC, sizeof(hd.magic));
+    hd.version = SNAPSHOT_VERSION;
+    hd.history_mode = (uint32_t)history_mode;
+    hd.rule_count = rules.count;
+    hd.dead = rules.dead;
+    hd.next_seq = next_seq;
+    hd.wal_lsn = wal_lsn;
+
+    //C checks keep recording queries while the snapshot is written, so each rule's count is read once and only that many are written
+    size_t n = rules.count;
+    uint64_t *query_start = malloc((n + 1) * sizeof(uint64_t));
+    if (!query_start) { perror("malloc"); exit(1); }
+    query_start[0] = 0;
+    for (size_t i = 0; i < n; i++) {
+        QueryHistory *h = rules.history[i];
+        pthread_mutex_lock(query_lock_for(rules.seq[i]));
+        size_t count = h -> distinct ? h -> distinct -> count : h -> query_count;
+        pthread_mutex_unlock(query_lock_for(rules.seq[i]));
+        query_start[i + 1] = query_start[i] + count;
+    }
+    hd.query_count = query_start[n];
+    if (history_mode == QUERY_HISTORY_DISTINCT)
+        for (size_t i = 0; i < n; i++)
+            if (query_start[i + 1] > query_start[i]) {
+                hd.set_count++;
+                hd.slot_count += queryset_slots_for(query_start[i + 1] - query_start[i]);
+            }
+
+    //the log is written up to wherever its tail is now - requests logged after this point are not in the snapshot
+    LogChunk *end_chunk = atomic_load(&log_tail);
+    size_t end_used = atomic_load(&end_chunk -> used);
+    size_t end_offset = end_used < end_chunk -> size ? end_used : end_chunk -> size;
+    for (LogChunk *c = log_head; c; c = c == end_chunk ? NULL : atomic_load(&c -> next))
+        hd.log_size += snapshot_log_extent(c, end_chunk, end_offset);
+
+    uint64_t off = 0;
+    int ok = snapshot_write(f, &hd, sizeof(hd), &off);  //rewritten with the offsets filled in once they are known
+    hd.ip_start = off;
+    ok = ok && snapshot_write(f, rules.ip_start, n * sizeof(uint32_t), &off);
+    hd.ip_end = off;
+    ok = ok && snapshot_write(f, rules.ip_end, n * sizeof(uint32_t), &off);
+    hd.port_start = off;
+    ok = ok && snapshot_write(f, rules.port_start, n * sizeof(int32_t), &off);
+    hd.port_end = off;
+    ok = ok && snapshot_write(f, rules.port_end, n * sizeof(int32_t), &off);
+    hd.seq = off;
+    ok = ok && snapshot_write(f, rules.seq, n * sizeof(uint64_t), &off);
+    //the histories come before what they point at, so where each of those sections will start is worked out first
+    hd.histories = off;
+    uint64_t after = off + n * sizeof(QueryHistory);  //a multiple of 8, as QueryHistory is
+    if (history_mode == QUERY_HISTORY_DISTINCT) {
+        hd.sets = after;
+        hd.pairs = hd.sets + hd.set_count * sizeof(QuerySet);
+        hd.hits = hd.pairs + (hd.query_count * sizeof(PackedQuery) + 7) / 8 * 8;
+        hd.slots = hd.hits + (hd.query_count * sizeof(uint32_t) + 7) / 8 * 8;
+    } else {
+        hd.queries = after;
+    }
+    uint64_t set = 0, slot = 0;
+    for (size_t i = 0; ok && i < n; i++) {
+        size_t first = (size_t)query_start[i], count = (size_t)(query_start[i + 1] - query_start[i]);
+        QueryHistory image = {0};
+        if (count && history_mode == QUERY_HISTORY_DISTINCT)
+            image.distinct = (QuerySet *)(uintptr_t)(hd.sets + set++ * sizeof(QuerySet));
+        else if (count) {
+            image.queries = (Query *)(uintptr_t)(hd.queries + first * sizeof(Query));
+            image.query_count = image.query_cap = count;  //full, so the next query copies it out of the snapshot
+        }
+        ok = fwrite(&image, sizeof(image), 1, f) == 1;
+    }
+    off += n * sizeof(QueryHistory);
+
+    if (history_mode == QUERY_HISTORY_FULL) {
+        for (size_t i = 0; ok && i < n; i++) {
+            QueryHistory *h = rules.history[i];
+            size_t count = query_start[i + 1] - query_start[i];
+            pthread_mutex_lock(query_lock_for(rules.seq[i]));  //the array may have been moved by a realloc since it was counted
+            ok = count == 0 || fwrite(h -> queries, sizeof(Query), count, f) == count;
+            pthread_mutex_unlock(query_lock_for(rules.seq[i]));
+        }
+        off += hd.query_count * sizeof(Query);  //Query is 8 bytes, so the next section is still aligned
+    } else {
+        set = slot = 0;
+        for (size_t i = 0; ok && i < n; i++) {
+            size_t first = (size_t)query_start[i], count = (size_t)(query_start[i + 1] - query_start[i]);
+            if (!count)
+                continue;
+            size_t slots = queryset_slots_for(count);
+            QuerySet image = { (PackedQuery *)(uintptr_t)(hd.pairs + first * sizeof(PackedQuery)), (uint32_t *)(uintptr_t)(hd.hits + first * sizeof(uint32_t)),
+                               count, count, (uint32_t *)(uintptr_t)(hd.slots + slot * sizeof(uint32_t)), slots - 1 };  //full, like the histories
+            ok = fwrite(&image, sizeof(image), 1, f) == 1;
+            slot += slots;
+        }
+        off += hd.set_count * sizeof(QuerySet);
+
+        for (size_t i = 0; ok && i < n; i++) {
+            size_t count = query_start[i + 1] - query_start[i];
+            pthread_mutex_lock(query_lock_for(rules.seq[i]));
+            ok = count == 0 || fwrite(rules.history[i] -> distinct -> pairs, sizeof(PackedQuery), count, f) == count;
+            pthread_mutex_unlock(query_lock_for(rules.seq[i]));
+        }
+        ok = ok && snapshot_pad(f, hd.query_count * sizeof(PackedQuery), &off);
+
+        for (size_t i = 0; ok && i < n; i++) {
+            size_t count = query_start[i + 1] - query_start[i];
+            pthread_mutex_lock(query_lock_for(rules.seq[i]));
+            ok = count == 0 || fwrite(rules.history[i] -> distinct -> hits, sizeof(uint32_t), count, f) == count;
+            pthread_mutex_unlock(query_lock_for(rules.seq[i]));
+        }
+        ok = ok && snapshot_pad(f, hd.query_count * sizeof(uint32_t), &off);
+
+        //the live slot tables may already index pairs added since counting, so each set's table is made again from just the pairs written
+        uint32_t *table = NULL;
+        size_t table_cap = 0;
+        for (size_t i = 0; ok && i < n; i++) {
+            size_t count = query_start[i + 1] - query_start[i];
+            if (!count)
+                continue;
+            size_t slots = queryset_slots_for(count);
+            if (slots > table_cap) {
+                free(table);
+                table = malloc(slots * sizeof(uint32_t));
+                if (!table) { perror("malloc"); exit(1); }
+                table_cap = slots;
+            }
+            memset(table, 0, slots * sizeof(uint32_t));
+            QuerySet *q = rules.history[i] -> distinct;
+            pthread_mutex_lock(query_lock_for(rules.seq[i]));
+            QuerySet view = { q -> pairs, NULL, count, count, table, slots - 1 };
+            for (size_t k = 0; k < count; k++) {
+                size_t h = queryset_home(&view, q -> pairs[k].ip, q -> pairs[k].port);
+                while (table[h])
+                    h = (h + 1) & view.mask;
+                table[h] = (uint32_t)(k + 1);
+            }
+            pthread_mutex_unlock(query_lock_for(rules.seq[i]));
+            ok = fwrite(table, sizeof(uint32_t), slots, f) == slots;
+        }
+        free(table);
+        ok = ok && snapshot_pad(f, hd.slot_count * sizeof(uint32_t), &off);
+    }
+
+    //IPv6 rules: as above, each history is counted once and only that many queries are written
+    size_t n6 = rules6.count;
+    uint64_t *count6 = malloc((n6 + 1) * sizeof(uint64_t));
+    if (!count6) { perror("malloc"); exit(1); }
+    hd.rule6_count = n6;
+    hd.rules6 = off;
+    for (size_t j = 0; ok && j < n6; j++) {
+        pthread_mutex_lock(query_lock_for(rules6.seq[j]));
+        count6[j] = rules6.history[j] -> count;
+        pthread_mutex_unlock(query_lock_for(rules6.seq[j]));
+        hd.query6_count += count6[j];
+        Rule6Image image = { rules6.ip_start[j], rules6.ip_end[j], rules6.port_start[j], rules6.port_end[j], rules6.seq[j], count6[j] };
+        ok = fwrite(&image, sizeof(image), 1, f) == 1;
+    }
+    off += n6 * sizeof(Rule6Image);
+
+    hd.queries6 = off;
+    for (size_t j = 0; ok && j < n6; j++) {
+        History6 *h = rules6.history[j];
+        pthread_mutex_lock(query_lock_for(rules6.seq[j]));
+        for (size_t k = 0; ok && k < count6[j]; k++) {
+            Query6 q;
+            memset(&q, 0, sizeof(q));  //no stray bytes in the padding after port
+            q.ip = h -> queries[k].ip;
+            q.port = h -> queries[k].port;
+            ok = fwrite(&q, sizeof(q), 1, f) == 1;
+        }
+        pthread_mutex_unlock(query_lock_for(rules6.seq[j]));
+    }
+    off += hd.query6_count * sizeof(Query6);
+
+    hd.hits6 = off;
+    if (history_mode == QUERY_HISTORY_DISTINCT) {
+        for (size_t j = 0; ok && j < n6; j++) {
+            pthread_mutex_lock(query_lock_for(rules6.seq[j]));
+            if (count6[j])
+                ok = fwrite(rules6.history[j] -> hits, sizeof(uint32_t), count6[j], f) == count6[j];
+            pthread_mutex_unlock(query_lock_for(rules6.seq[j]));
+        }
+        off += hd.query6_count * sizeof(uint32_t);
+        if (ok && off % 8) {
+            static const char zeroes[4];
+            ok = fwrite(zeroes, 1, 4, f) == 4;
+            off += 4;
+        }
+    }
+    free(count6);
+
+    hd.log = off;
+    LogChunk image = { NULL, (size_t)hd.log_size, (size_t)hd.log_size };  //a full chunk - requests logged after loading go into a fresh chunk linked after it
+    ok = ok && snapshot_write(f, &image, sizeof(image), &off);
+    for (LogChunk *c = log_head; ok && c; c = c == end_chunk ? NULL : atomic_load(&c -> next)) {
+        size_t extent = snapshot_log_extent(c, end_chunk, end_offset);
+        ok = extent == 0 || fwrite(c -> data, 1, extent, f) == extent;
+        off += extent;
+    }
+    hd.file_size = off;
+    free(query_start);
+
+    ok = ok && fseek(f, 0, SEEK_SET) == 0 && fwrite(&hd, sizeof(hd), 1, f) == 1;
+    return ok;
+}
+
+//writes a snapshot of every rule, every recorded query and the request log to path
+//the snapshot is written to path.tmp, flushed to disk and then renamed over path, so path always holds a complete snapshot
+//rules_lock is held for reading while it is written: C checks carry on, A, D and F wait
+//once it is in place the write-ahead log (if there is one) is emptied, since the snapshot holds every change recorded in it
+//returns 1 on success, 0 (with errno set) on failure
+int saveSnapshot(const char *path) {
+    char tmp[4096];
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp)) {
+        errno = ENAMETOOLONG;
+        return 0;
+    }
+    FILE *f = fopen(tmp, "wb");
+    if (!f)
+        return 0;
+
+    //rules_lock is held until the snapshot is renamed into place, so that the write-ahead log can be emptied before any new record goes into it
+    pthread_once(&log_once, log_init);
+    pthread_rwlock_rdlock(&rules_lock);
+    int ok = snapshot_write_all(f);
+    ok = ok && fflush(f) == 0 && fsync(fileno(f)) == 0;
+    if (fclose(f) != 0)
+        ok = 0;
+    if (ok && rename(tmp, path) != 0)
+        ok = 0;
+    if (!ok) {
+        int saved_errno = errno;
+        pthread_rwlock_unlock(&rules_lock);
+        unlink(tmp);
+        errno = saved_errno;
+        return 0;
+    }
+
+    sync_parent_dir(path);  //the rename only survives a crash once the directory holding path is on disk too
+    wal_checkpoint();
+    pthread_rwlock_unlock(&rules_lock);
+    return 1;
+}
+
+//checks that section [offset, offset + size) lies inside a file of file_size bytes, starts on an 8-byte boundary
+//and starts at or after *end, where the section before it ended - then moves *end past it
+//the sections are used in place and patched where they lie, so no two may overlap, or the header
+static int snapshot_section_ok(uint64_t offset, uint64_t size, uint64_t *end, uint64_t file_size) {
+    if (offset % 8 != 0 || offset < *end || offset > file_size || size > file_size - offset)
+        return 0;
+    *end = offset + size;
+    return 1;
+}
+
+//checks that every history (and in QUERY_HISTORY_DISTINCT mode every set) points at the next stretch of its sections, full to capacity,
+//so that they can be used in place - the pointers are still the offsets the file holds
+static int snapshot_histories_valid(const char *map, const SnapshotHeader *hd) {
+    const QueryHistory *histories = (const QueryHistory *)(map + hd -> histories);
+    const QuerySet *sets = (const QuerySet *)(map + hd -> sets);
+    uint64_t queries = 0, set = 0, slots = 0;
+    for (uint64_t i = 0; i < hd -> rule_count; i++) {
+        const QueryHistory *h = &histories[i];
+        if (hd -> history_mode == QUERY_HISTORY_FULL) {
+            uint64_t count = h -> query_count;
+            if (h -> distinct || h -> query_cap != count || count > hd -> query_count - queries ||
+                (uintptr_t)h -> queries != (count ? hd -> queries + queries * sizeof(Query) : 0))
+                return 0;
+            queries += count;
+            continue;
+        }
+
+        if (h -> queries || h -> query_count || h -> query_cap)
+            return 0;
+        if (!h -> distinct)
+            continue;
+        if (set == hd -> set_count || (uintptr_t)h -> distinct != hd -> sets + set * sizeof(QuerySet))
+            return 0;
+        const QuerySet *q = &sets[set++];
+        if (q -> count == 0 || q -> cap != q -> count || q -> count > hd -> query_count - queries ||
+            q -> mask + 1 != queryset_slots_for(q -> count) || q -> mask + 1 > hd -> slot_count - slots ||
+            (uintptr_t)q -> pairs != hd -> pairs + queries * sizeof(PackedQuery) || (uintptr_t)q -> hits != hd -> hits + queries * 4 ||
+            (uintptr_t)q -> slots != hd -> slots + slots * 4)
+            return 0;
+        const uint32_t *table = (const uint32_t *)(map + hd -> slots) + slots;
+        size_t used = 0;
+        for (size_t k = 0; k <= q -> mask; k++) {  //a slot naming a pair that is not there would be followed out of bounds, and a full table would never end a probe
+            if (table[k] > q -> count)
+                return 0;
+            used += table[k] != 0;
+        }
+        if (used != q -> count)
+            return 0;
+        queries += q -> count;
+        slots += q -> mask + 1;
+    }
+    return queries == hd -> query_count && set == hd -> set_count && slots == hd -> slot_count;
+}
+
+//checks a mapped snapshot before any of it is used
+static int snapshot_valid(const char *map, size_t size) {
+    if (size < sizeof(SnapshotHeader))
+        return 0;
+    const SnapshotHeader *hd = (const SnapshotHeader *)map;
+    if (memcmp(hd -> magic, SNAPSHOT_MAGIC, sizeof(hd -> magic)) != 0 || hd -> version != SNAPSHOT_VERSION || hd -> file_size != size)
+        return 0;
+    if (hd -> history_mode != QUERY_HISTORY_FULL && hd -> history_mode != QUERY_HISTORY_DISTINCT)
+        return 0;
+
+    uint64_t n = hd -> rule_count, n6 = hd -> rule6_count;
+    if (n > size || hd -> query_count > size || hd -> set_count > size || hd -> slot_count > size || hd -> log_size > size ||
+        n6 > size || hd -> query6_count > size)  //keeps the size sums below from overflowing
+        return 0;
+    int distinct = hd -> history_mode == QUERY_HISTORY_DISTINCT;
+    uint64_t end = sizeof(SnapshotHeader);  //the sections are checked in the order they are written
+    if (!snapshot_section_ok(hd -> ip_start, n * 4, &end, size) || !snapshot_section_ok(hd -> ip_end, n * 4, &end, size) ||
+        !snapshot_section_ok(hd -> port_start, n * 4, &end, size) || !snapshot_section_ok(hd -> port_end, n * 4, &end, size) ||
+        !snapshot_section_ok(hd -> seq, n * 8, &end, size) || !snapshot_section_ok(hd -> histories, n * sizeof(QueryHistory), &end, size) ||
+        (!distinct && !snapshot_section_ok(hd -> queries, hd -> query_count * sizeof(Query), &end, size)) ||
+        (distinct && !snapshot_section_ok(hd -> sets, hd -> set_count * sizeof(QuerySet), &end, size)) ||
+        (distinct && !snapshot_section_ok(hd -> pairs, hd -> query_count * sizeof(PackedQuery), &end, size)) ||
+        (distinct && !snapshot_section_ok(hd -> hits, hd -> query_count * 4, &end, size)) ||
+        (distinct && !snapshot_section_ok(hd -> slots, hd -> slot_count * 4, &end, size)) ||
+        !snapshot_section_ok(hd -> rules6, n6 * sizeof(Rule6Image), &end, size) ||
+        !snapshot_section_ok(hd -> queries6, hd -> query6_count * sizeof(Query6), &end, size) ||
+        (distinct && !snapshot_section_ok(hd -> hits6, hd -> query6_count * 4, &end, size)) ||
+        !snapshot_section_ok(hd -> log, sizeof(LogChunk) + hd -> log_size, &end, size))
+        return 0;
+
+    //find_rule_by_seq needs seq sorted
+    const uint64_t *seq = (const uint64_t *)(map + hd -> seq);
+    for (uint64_t i = 0; i < n; i++)
+        if (seq[i] == 0 || seq[i] >= hd -> next_seq || (i > 0 && seq[i] <= seq[i - 1]))
+            return 0;
+    if (!snapshot_histories_valid(map, hd))
+        return 0;
+
+    //the same goes for the IPv6 rules, whose query counts have to add up to the queries6 section
+    const Rule6Image *images6 = (const Rule6Image *)(map + hd -> rules6);
+    uint64_t queries6 = 0;
+    for (uint64_t j = 0; j < n6; j++) {
+        if (images6[j].seq == 0 || images6[j].seq >= hd -> next_seq || (j > 0 && images6[j].seq <= images6[j - 1].seq) ||
+            images6[j].query_count > hd -> query6_count - queries6)
+            return 0;
+        queries6 += images6[j].query_count;
+    }
+    if (queries6 != hd -> query6_count)
+        return 0;
+
+    //every log entry has to end inside the log
+    const LogChunk *c = (const LogChunk *)(map + hd -> log);
+    if (c -> size != hd -> log_size)
+        return 0;
+    for (size_t off = 0; off < c -> size; ) {
+        if (c -> size - off < sizeof(uint32_t))
+            return 0;
+        uint32_t h;
+        memcpy(&h, c -> data + off, sizeof(h));
+        if (h == 0 || h == LOG_END || h - 1 > c -> size - off - sizeof(uint32_t))
+            return 0;
+        off += (sizeof(uint32_t) + (h - 1) + 3) & ~(size_t)3;
+    }
+    return 1;
+}
+
+//replaces every rule, recorded query and logged request with the contents of the snapshot at path (as if by an F and then a restore)
+//the file is mapped rather than read: the rule columns, query histories (query arrays or distinct sets) and log are used where they lie, and are only copied to the heap when they grow
+//the only per-rule work is turning the histories' stored offsets into addresses - the shard indexes are then built in one go by lookup_build, and the exact-match hash rebuilt
+//the file must not be truncated or written over while it is loaded, since untouched pages of the mapping still read from it - saveSnapshot renames a new file over it, which is safe
+//IPv6 rules and their queries are copied into the rules6 table
+//it has to be called before openWal, since the write-ahead log is replayed on top of the snapshot - once there is one it fails with EBUSY
+//returns 1 on success, 0 (with errno set) if the file cannot be read or is not a valid snapshot - the current state is then left alone
+int loadSnapshot(const char *path) {
+    if (wal_fd >= 0) {
+        errno = EBUSY;
+        return 0;
+    }
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return 0;
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return 0;
+    }
+    size_t size = (size_t)st.st_size;
+    char *map = size ? mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0) : MAP_FAILED;  //private: changes stay in this process and never reach the file
+    close(fd);
+    if (map == MAP_FAILED) {
+        if (!size) errno = EINVAL;
+        return 0;
+    }
+    if (!snapshot_valid(map, size)) {
+        munmap(map, size);
+        errno = EINVAL;
+        return 0;
+    }
+    const SnapshotHeader *hd = (const SnapshotHeader *)map;
+
+    pthread_once(&log_once, log_init);
+    lock_for_write(0, SHARD_COUNT - 1);
+    handle_F();  //drops the current state, and any snapshot loaded before this one
+
+    snapshot_map = map;
+    snapshot_size = size;
+    size_t n = (size_t)hd -> rule_count;
+    if (n) {
+        rules.ip_start = (uint32_t *)(map + hd -> ip_start);
+        rules.ip_end = (uint32_t *)(map + hd -> ip_end);
+        rules.port_start = (int32_t *)(map + hd -> port_start);
+        rules.port_end = (int32_t *)(map + hd -> port_end);
+        rules.seq = (uint64_t *)(map + hd -> seq);
+        rules.history = arena_alloc(n * sizeof(QueryHistory *));
+    }
+    rules.count = rules.cap = n;
+    rules.dead = (size_t)hd -> dead;
+    next_seq = hd -> next_seq;
+    wal_lsn = hd -> wal_lsn;
+    history_mode = (int)hd -> history_mode;
+
+    //the histories and sets stay where they are - only their offsets are turned into addresses
+    QueryHistory *histories = (QueryHistory *)(map + hd -> histories);
+    for (size_t i = 0; i < n; i++) {
+        QueryHistory *h = &histories[i];
+        rules.history[i] = h;
+        if (h -> queries)
+            h -> queries = (Query *)(map + (uintptr_t)h -> queries);
+        if (h -> distinct)
+            h -> distinct = (QuerySet *)(map + (uintptr_t)h -> distinct);
+    }
+    QuerySet *sets = (QuerySet *)(map + hd -> sets);
+    for (size_t j = 0; j < (size_t)hd -> set_count; j++) {
+        sets[j].pairs = (PackedQuery *)(map + (uintptr_t)sets[j].pairs);
+        sets[j].hits = (uint32_t *)(map + (uintptr_t)sets[j].hits);
+        sets[j].slots = (uint32_t *)(map + (uintptr_t)sets[j].slots);
+    }
+
+    lookup_build();
+    hash_rebuild(n);
+
+    //IPv6 rules are copied out of the snapshot, queries and all
+    const Rule6Image *images6 = (const Rule6Image *)(map + hd -> rules6);
+    const Query6 *queries6 = (const Query6 *)(map + hd -> queries6);
+    const uint32_t *hits6 = (const uint32_t *)(map + hd -> hits6);
+    int distinct = history_mode == QUERY_HISTORY_DISTINCT;
+    size_t first6 = 0;
+    for (size_t j = 0; j < (size_t)hd -> rule6_count; j++) {
+        Rule6 r6 = { images6[j].ip_start, images6[j].ip_end, images6[j].port_start, images6[j].port_end };
+        size_t at = rule6_append(&r6, images6[j].seq);  //before rules6.history is read, since appending can move it
+        History6 *h = rules6.history[at];
+        for (size_t k = first6; k < first6 + images6[j].query_count; k++)
+            history6_push(h, queries6[k].ip, queries6[k].port, distinct ? hits6[k] : 0, distinct);
+        first6 += images6[j].query_count;
+    }
+
+    //the log restarts from the snapshot's chunk - the empty one handle_F made is not needed
+    LogChunk *c = (LogChunk *)(map + hd -> log);
+    atomic_store(&c -> next, NULL);
+    atomic_store(&c -> used, c -> size);
+    arena_free(log_head);
+    log_head = c;
+    atomic_store(&log_tail, c);
+
+    unlock_for_write(0, SHARD_COUNT - 1);
+    return 1;
+}
+
+// bulk loading - a buffer of rules, one per line, is parsed by several threads at once and then added under a single write lock
+// nothing is added unless every line is a valid rule, and the rules table and exact-match hash are sized once for the lot
+#define BULK_MAX_THREADS 16
+#define BULK_THREAD_BYTES (1 << 20)  //one parsing thread per MB of rules, so small loads are parsed on the calling thread
+
+// BulkRule is one parsed line of a bulk load
+typedef struct {
+    int v6;
+    union {
+        Rule r4;
+        Rule6 r6;
+    };
+} BulkRule;
+
+// BulkPart is the run of whole lines one thread parses
+typedef struct {
+    pthread_t tid;
+    const char *start, *end;
+    BulkRule *rules;
+    size_t count, cap;
+    size_t lines;  //lines read so far, blank ones included
+    size_t v4;  //how many of the rules are IPv4
+    int bad;  //set when a line did not parse - parsing stops there, so it is line number lines of the part
+} BulkPart;
+
+//parses every line of one part - it stops at the first line that is not a rule
+static void *bulk_parse_part(void *arg) {
+    BulkPart *p = arg;
+    char line[256];  //every valid rule fits, with or without its "A "
+    for (const char *s = p -> start; s < p -> end; ) {
+        const char *nl = memchr(s, '\n', (size_t)(p -> end - s));
+        size_t n = (size_t)((nl ? nl : p -> end) - s);
+        p -> lines++;
+        if (n > 0 && s[n - 1] == '\r')  //accept "\r\n" line endings
+            n--;
+        if (n > 0) {  //blank lines are skipped
+            if (n >= sizeof(line) || memchr(s, '\0', n)) {
+                p -> bad = 1;
+                return NULL;
+            }
+            memcpy(line, s, n);
+            line[n] = '\0';
+            const char *args = strncmp(line, "A ", 2) == 0 ? line + 2 : line;  //lines can be whole A requests too
+
+            if (p -> count == p -> cap) {
+                p -> cap = p -> cap ? p -> cap * 2 : 1024;
+                BulkRule *tmp = realloc(p -> rules, p -> cap * sizeof(BulkRule));
+                if (!tmp) { perror("realloc"); exit(1); }
+                p -> rules = tmp;
+            }
+            BulkRule *b = &p -> rules[p -> count];
+            b -> v6 = 0;
+            if (parse_rule(args, &b -> r4))
+                p -> v4++;
+            else if (parse_rule6(args, &b -> r6))
+                b -> v6 = 1;
+            else {
+                p -> bad = 1;
+                return NULL;
+            }
+            p -> count++;
+        }
+        s = nl ? nl + 1 : p -> end;
+    }
+    return NULL;
+}
+
+//splits buf[0 .. len) into parts of whole lines and parses them, in parallel when there is enough of it
+//returns the number of parts (each to be freed with bulk_free) - if a line is not a rule, *bad_line is set to its line number, counting from 1
+static int bulk_parse(const char *buf, size_t len, BulkPart *parts, size_t *bad_line) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t want = len / BULK_THREAD_BYTES + 1;
+    if (cpus > 0 && want > (size_t)cpus)
+        want = (size_t)cpus;
+    if (want > BULK_MAX_THREADS)
+        want = BULK_MAX_THREADS;
+
+    int n = 0;
+    for (const char *s = buf, *end = buf + len; s < end; n++) {
+        const char *cut = n + 1 == (int)want ? end : buf + len / want * (size_t)(n + 1);
+        if (cut < s)
+            cut = s;
+        const char *nl = cut < end ? memchr(cut, '\n', (size_t)(end - cut)) : NULL;  //parts end just after a '\n'
+        memset(&parts[n], 0, sizeof(parts[n]));
+        parts[n].start = s;
+        parts[n].end = nl ? nl + 1 : end;
+        s = parts[n].end;
+    }
+    for (int k = 1; k < n; k++)
+        if (pthread_create(&parts[k].tid, NULL, bulk_parse_part, &parts[k]) != 0) { perror("pthread_create"); exit(1); }
+    if (n > 0)
+        bulk_parse_part(&parts[0]);
+    for (int k = 1; k < n; k++)
+        pthread_join(parts[k].tid, NULL);
+
+    *bad_line = 0;
+    size_t before = 0;  //lines in the parts before this one
+    for (int k = 0; k < n && !*bad_line; k++) {
+        if (parts[k].bad)
+            *bad_line = before + parts[k].lines;
+        before += parts[k].lines;
+    }
+    return n;
+}
+
+//adds the parsed rules in line order, just as one A after another would - called with rules_lock and every shard locked for writing
+//the IPv4 rules are appended to the table first, with their histories allocated together, and the shards are then built over the whole table by lookup_build
+//rather than having each rule inserted on its own - into empty shards as they are, otherwise after shards_clear has emptied them
+static void bulk_apply(const BulkPart *parts, int n) {
+    size_t v4 = 0;
+    for (int k = 0; k < n; k++)
+        v4 += parts[k].v4;
+    if (rules.count + v4 > rules.cap)
+        table_grow(rules.count + v4);  //once, rather than doubling its way up
+    arena_alloc_many(sizeof(QueryHistory), v4, (void **)(rules.history + rules.count));
+
+    for (int k = 0; k < n; k++) {
+        for (size_t j = 0; j < parts[k].count; j++) {
+            const BulkRule *b = &parts[k].rules[j];
+            if (b -> v6) {
+                rule6_add(&b -> r6);
+                continue;
+            }
+            size_t i = rules.count++;
+            rules.ip_start[i] = b -> r4.ip_start;
+            rules.ip_end[i] = b -> r4.ip_end;
+            rules.port_start[i] = b -> r4.port_start;
+            rules.port_end[i] = b -> r4.port_end;
+            rules.seq[i] = next_seq++;
+            *rules.history[i] = (QueryHistory){0};
+        }
+    }
+    if (!v4)
+        return;
+    shards_clear();
+    lookup_build();
+    hash_rebuild(rules.count);  //one pass over the table instead of an insert (and the odd rebuild) per rule
+}
+
+static void bulk_free(BulkPart *parts, int n) {
+    for (int k = 0; k < n; k++)
+        free(parts[k].rules);
+}
+
+//adds every rule in buf[0 .. len), one per line, each written as the arguments of an A ("<ip>[-<ip>] <port>[-<port>]") or as the whole A request
+//it is all or nothing: if a line is not a valid rule nothing is added, *bad_line (if bad_line is not NULL) is set to its line number counting from 1, and errno to EINVAL
+//the lines are parsed by up to BULK_MAX_THREADS threads before any lock is taken, then added under one write lock in line order, as if by one A each
+//blank lines are skipped and "\r\n" line endings are accepted; the rules are not put in the request log, since no request was made
+//with a write-ahead log open the whole load is one record, made durable before loadRules returns
+//returns 1 on success, 0 (with errno set) on failure
+int loadRules(const char *buf, size_t len, size_t *bad_line) {
+    if (wal_fd >= 0 && len > UINT32_MAX) {  //too long for one write-ahead log record
+        errno = EFBIG;
+        return 0;
+    }
+    BulkPart parts[BULK_MAX_THREADS];
+    size_t bad;
+    int n = bulk_parse(buf, len, parts, &bad);
+    if (bad_line)
+        *bad_line = bad;
+    size_t count = 0;
+    for (int k = 0; k < n; k++)
+        count += parts[k].count;
+    if (bad || count == 0) {  //nothing to add either way
+        bulk_free(parts, n);
+        if (bad)
+            errno = EINVAL;
+        return !bad;
+    }
+
+    pthread_once(&log_once, log_init);
+    lock_for_write(0, SHARD_COUNT - 1);
+    bulk_apply(parts, n);
+    uint64_t lsn = wal_append('B', NULL, buf, len);
+    unlock_for_write(0, SHARD_COUNT - 1);
+    bulk_free(parts, n);
+    if (lsn)
+        wal_commit(lsn);
+    return 1;
+}
+
+//loadRules on the contents of the file at path, which is mapped rather than read
+//returns 1 on success, 0 (with errno set) if the file cannot be read or a line in it is not a rule
+int loadRulesFile(const char *path, size_t *bad_line) {
+    if (bad_line)
+        *bad_line = 0;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return 0;
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return 0;
+    }
+    size_t size = (size_t)st.st_size;
+    if (size == 0) {
+        close(fd);
+        return 1;  //no rules to add
+    }
+    char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return 0;
+    int ok = loadRules(map, size, bad_line);
+    int saved_errno = errno;
+    munmap(map, size);
+    errno = saved_errno;
+    return ok;
+}
+
+//reads the range of an IPv6 A or D back from the len bytes of its request text, which are not '\0'-terminated in the log file
+static int wal_text_rule6(const char *text, size_t len, Rule6 *out) {
+    char request[256];  //the most a request that parse_rule6 accepts can take is well under this
+    if (len >= sizeof(request))
+        return 0;
+    memcpy(request, text, len);
+    request[len] = '\0';
+    return parse_rule6(request + 2, out);
+}
+
+//opens (or creates) the write-ahead log at path, replays the changes it holds and from then on records every change to the rules in it
+//call it after loadSnapshot, if there is a snapshot: only records the snapshot does not already hold are replayed
+//replayed requests are put back in the request log, but the C checks and failed requests made between them were never recorded and are gone
+//a record left half-written by a crash ends the replay, and is cut off the end of the file
+//an A or D (text or binary) or F is only answered once its record has been fdatasynced - requests that arrive within window_us of each other share one fdatasync
+//returns 1 on success, 0 (with errno set) if the log cannot be opened or read
+int openWal(const char *path, unsigned window_us) {
+    if (wal_fd >= 0) {
+        errno = EBUSY;
+        return 0;
+    }
+    int fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return 0;
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return 0;
+    }
+    size_t size = (size_t)st.st_size;
+    char *data = malloc(size ? size : 1);
+    if (!data) { perror("malloc"); exit(1); }
+    for (size_t got = 0; got < size; ) {
+        ssize_t n = pread(fd, data + got, size - got, (off_t)got);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            int saved_errno = n < 0 ? errno : EIO;
+            free(data);
+            close(fd);
+            errno = saved_errno;
+            return 0;
+        }
+        got += (size_t)n;
+    }
+
+    pthread_once(&log_once, log_init);
+    lock_for_write(0, SHARD_COUNT - 1);
+    size_t off = 0;
+    while (size - off >= sizeof(WalRecord)) {
+        WalRecord rec;
+        memcpy(&rec, data + off, sizeof(rec));  //records are packed back to back, so they are not aligned in data
+        const char *text = data + off + sizeof(rec);
+        if (rec.text_len > size - off - sizeof(rec) || wal_check(&rec, text) != rec.check)
+            break;
+        if (rec.op != 'A' && rec.op != 'D' && rec.op != 'F' && rec.op != 'a' && rec.op != 'd' && rec.op != 'B')
+            break;
+        Rule6 r6;
+        if ((rec.op == 'a' || rec.op == 'd') && (rec.text_len < 2 || !wal_text_rule6(text, rec.text_len, &r6)))
+            break;
+
+        if (rec.lsn > wal_lsn) {  //anything older is already in the snapshot
+            if (rec.text_len && rec.op != 'B')  //a bulk load was never in the request log
+                log_request(text, rec.text_len);  //logged first, the way execute does it - an F then clears its own entry
+            Rule r = { rec.ip_start, rec.ip_end, rec.port_start, rec.port_end };
+            if (rec.op == 'B') {
+                BulkPart parts[BULK_MAX_THREADS];
+                size_t bad;
+                int n = bulk_parse(text, rec.text_len, parts, &bad);
+                if (!bad)
+                    bulk_apply(parts, n);
+                bulk_free(parts, n);
+                if (bad)  //it was checked before it was written, so the record is damaged
+                    break;
+            } else if (rec.op == 'A')
+                rule_add(&r);
+            else if (rec.op == 'D')
+                rule_delete(&r);
+            else if (rec.op == 'a')
+                rule6_add(&r6);
+            else if (rec.op == 'd')
+                rule6_delete(&r6);
+            else
+                handle_F();
+            wal_lsn = rec.lsn;
+        }
+        off += sizeof(rec) + rec.text_len;
+    }
+    free(data);
+    if (off < size && (ftruncate(fd, (off_t)off) != 0 || fdatasync(fd) != 0)) {  //drops the torn record so that new ones are not written after it
+        int saved_errno = errno;
+        unlock_for_write(0, SHARD_COUNT - 1);
+        close(fd);
+        errno = saved_errno;
+        return 0;
+    }
+    sync_parent_dir(path);  //in case the log was only just created
+
+    wal_buffered = wal_durable = wal_lsn;
+    wal_window_us = window_us;
+    wal_fd = fd;
+    unlock_for_write(0, SHARD_COUNT - 1);
+    return 1;
+}